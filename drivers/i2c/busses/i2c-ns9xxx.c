@@ -13,18 +13,37 @@
  */
 
 #include <linux/clk.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/err.h>
+#include <linux/eventfd.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/i2c.h>
+#include <linux/i2c-smbus.h>
 #include <linux/interrupt.h>
+#include <linux/kref.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/i2c-ns9xxx.h>
+#include <linux/i2c-ns9xxx-dev.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/sysfs.h>
 #include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
 
 #include <asm/gpio.h>
 #include <asm/io.h>
+#include <asm/uaccess.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/i2c_ns9xxx.h>
 
 /* registers */
 #define I2C_CMD				0x00
@@ -64,6 +83,17 @@
 #define I2C_IRQ_TXDATA			(3 << 8)
 #define I2C_IRQ_RXDATA			(4 << 8)
 #define I2C_IRQ_CMDACK			(5 << 8)
+#define I2C_IRQ_S_RXABORT		(8 << 8)	/* slave codes from here */
+#define I2C_IRQ_S_CMDREQ		(9 << 8)
+#define I2C_IRQ_S_NOACK			(10 << 8)
+#define I2C_IRQ_S_TXDATA_1ST		(11 << 8)
+#define I2C_IRQ_S_RXDATA_1ST		(12 << 8)
+#define I2C_IRQ_S_TXDATA		(13 << 8)
+#define I2C_IRQ_S_RXDATA		(14 << 8)
+#define I2C_IRQ_S_GCA			(15 << 8)
+
+/* slave address bitfields */
+#define I2C_SLAVEADDR_GCDI		(1 << 11)	/* ignore general call */
 
 #define I2C_NORMALSPEED			100000
 #define I2C_HIGHSPEED			400000
@@ -99,6 +129,38 @@ static int scl_delay = SCL_DELAY;
 module_param(scl_delay, int, S_IRUSR | S_IRGRP | S_IROTH);
 MODULE_PARM_DESC(scl_delay, "SCL delay parameter for NS9xxx I2C");
 
+#define NS9XXX_ACKPOLL_INTERVAL_MAX_US	100000
+#define NS9XXX_ACKPOLL_TIMEOUT_MAX_MS	1000
+
+static int ackpoll_interval;
+module_param(ackpoll_interval, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(ackpoll_interval, "Microseconds between ACK polls, 0 to poll back to back (at most 100000)");
+
+static int ackpoll_timeout = 25;
+module_param(ackpoll_timeout, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(ackpoll_timeout, "Milliseconds to poll for an ACK, e.g. during an EEPROM write cycle (at most 1000)");
+
+#define NS9XXX_SLAVE_STOP_MAX_US	100000
+
+static int slave_stop_us = 500;
+module_param(slave_stop_us, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(slave_stop_us, "Microseconds without a slave interrupt after which the frame is taken to have ended (at most 100000)");
+
+static int write_behind_ms = 5;
+module_param(write_behind_ms, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(write_behind_ms, "Milliseconds to hold write-behind writes before flushing them");
+
+/*
+ * The writable parameters can change at any time; read them once and
+ * clamp them before they are scaled to nanoseconds.
+ */
+static u64 ns9xxx_param_ns(const int *param, int max, u64 unit)
+{
+	int val = ACCESS_ONCE(*param);
+
+	return (u64)clamp(val, 0, max) * unit;
+}
+
 enum i2c_int_state {
 	I2C_INT_AWAITING,
 	I2C_INT_OK,
@@ -107,6 +169,306 @@ enum i2c_int_state {
 	I2C_INT_ABORT
 };
 
+/*
+ * who drives the master command module; show_ns9xxx_phase() in
+ * trace/events/i2c_ns9xxx.h names the values
+ */
+enum ns9xxx_engine_phase {
+	NS9XXX_PHASE_IDLE = 0,		/* nothing on the bus, queue may start */
+	NS9XXX_PHASE_XFER,		/* address/data phase of dev_data->cur */
+	NS9XXX_PHASE_STOP,		/* STOP issued, next transaction on ACK */
+	NS9XXX_PHASE_RESTART,		/* STOP after lost arbitration, retry */
+	NS9XXX_PHASE_ACKPOLL,		/* STOP after address NACK, poll again */
+	NS9XXX_PHASE_ACKWAIT,		/* bus idle until ackpoll_timer */
+	NS9XXX_PHASE_SYNC		/* owned by ns9xxx_i2c_send_cmd() users */
+};
+
+/* number of restarts after lost arbitration */
+#define NS9XXX_ARBITLOST_RETRIES	10
+
+/* ns9xxx_xact flags */
+#define NS9XXX_XACT_ACKPOLL		0x0001	/* retry address NACKs */
+#define NS9XXX_XACT_REGREAD		0x0002	/* register address, then read */
+#define NS9XXX_XACT_TSTAMP		0x0004	/* stamp address and STOP ACKs */
+
+/*
+ * Transaction classes, each with its own queue, served in this order. The
+ * class comes from the address of the first message unless the submitter
+ * picks one.
+ */
+enum ns9xxx_qos {
+	NS9XXX_QOS_URGENT,
+	NS9XXX_QOS_NORMAL,
+	NS9XXX_QOS_BULK,
+	NS9XXX_QOS_CLASSES
+};
+
+#define NS9XXX_QOS_AUTO			NS9XXX_QOS_CLASSES
+
+struct ns9xxx_qos_stats {
+	unsigned long		count;		/* transactions started, not
+						 * counting resumed pieces */
+	u64			total_ns;	/* time spent queued */
+	u64			max_ns;
+	unsigned long		splits;		/* bulk transactions preempted */
+};
+
+struct ns9xxx_i2c;
+
+/*
+ * One bus transaction (START, messages, STOP). It is stepped through
+ * entirely by the interrupt handler; ->complete() is called from there
+ * with dev_data->lock held once the last byte is done.
+ */
+struct ns9xxx_xact {
+	struct list_head	list;
+
+	struct i2c_msg		*msgs;
+	int			num;
+	int			msg;		/* message in progress */
+	int			pos;		/* byte in progress */
+	int			first;		/* message to (re)start from */
+	int			retries;
+	int			result;		/* num or -errno */
+	unsigned int		bytes;		/* acknowledged so far */
+
+	unsigned int		flags;
+	u64			ackpoll_ns;	/* how long to poll */
+	u64			ackpoll_until;	/* set on the first NACK */
+
+	/* precomputed for NS9XXX_XACT_REGREAD */
+	u32			masteraddr;
+	u32			cmd[2];
+
+	ktime_t			completed;	/* for NS9XXX_HIST_WAKEUP */
+
+	int			qos;		/* requested class */
+	int			prio;		/* class it was queued with */
+	ktime_t			queued;
+	u64			deadline;	/* ktime in ns, or 0 */
+	u64			wire_ns;	/* estimated bus time left */
+
+	/* NS9XXX_XACT_TSTAMP, 0 if the bus never got that far */
+	ktime_t			ts_addr;	/* first address acknowledged */
+	ktime_t			ts_stop;	/* STOP acknowledged */
+
+	void			(*complete)(struct ns9xxx_i2c *dev_data,
+						struct ns9xxx_xact *xact);
+	struct completion	done;
+};
+
+/*
+ * kernel side of a struct ns9xxx_i2c_ring, allocated with vmalloc_user().
+ * Userspace can write anything to the mapped header, so the geometry and
+ * the kernel's own index are kept here and only ever copied out to hdr.
+ */
+struct ns9xxx_ring {
+	struct ns9xxx_i2c_ring	*hdr;
+	unsigned long		size;
+	u32			entries;
+	u32			mask;
+	u32			entry_size;
+	u32			offset;
+	u32			head;		/* kernel is the producer */
+	u32			tail;		/* kernel is the consumer */
+};
+
+#define NS9XXX_RING_HDR_SIZE		64
+#define NS9XXX_RING_MAX_ENTRIES		16384
+
+struct ns9xxx_sample_slot {
+	struct ns9xxx_xact	xact;
+	struct i2c_msg		msgs[2];
+	struct ns9xxx_i2c_sample_entry entry;
+	u8			buf[NS9XXX_I2C_SAMPLE_MAX];
+	u16			index;
+	int			busy;		/* queued or on the bus */
+	u64			due;		/* ns, CLOCK_MONOTONIC */
+};
+
+/* minimum sampling period, the bus cannot go much faster anyway */
+#define NS9XXX_SAMPLE_MIN_PERIOD_US	100
+
+struct ns9xxx_sampler {
+	struct file		*owner;		/* NULL if no ring */
+	struct ns9xxx_sample_slot *slots;
+	int			num;
+	int			running;
+	struct hrtimer		timer;
+	struct ns9xxx_ring	ring;
+	wait_queue_head_t	wait;
+};
+
+/*
+ * Read cache rule and entry: a register read of len bytes from reg of the
+ * 7-bit address addr, answered from data until expires.
+ */
+#define NS9XXX_CACHE_ENTRIES		16
+#define NS9XXX_CACHE_MAX_LEN		32
+
+struct ns9xxx_cache_entry {
+	u16			addr;
+	u8			reg;
+	u8			len;
+	u64			ttl_ns;		/* 0 if the rule is unused */
+	u32			id;		/* changes when the rule is set */
+	u32			gen;		/* changes on invalidation */
+	int			valid;
+	u64			expires;
+	unsigned long		hits;
+	unsigned long		misses;
+	u8			data[NS9XXX_CACHE_MAX_LEN];
+};
+
+/*
+ * Write-behind: register writes of up to NS9XXX_WB_ON_MAX_LEN bytes
+ * (register address included) to enabled devices, NS9XXX_WB_MAX_LEN to
+ * coalescing ones, held until the next flush.
+ */
+#define NS9XXX_WB_ENTRIES		16
+#define NS9XXX_WB_MAX_LEN		32
+#define NS9XXX_WB_ON_MAX_LEN		8
+
+/* wb_addr values */
+#define NS9XXX_WB_ON			1
+#define NS9XXX_WB_COALESCE		2	/* and merge adjacent registers */
+
+/* START, address, register address and STOP saved per coalesced write */
+#define NS9XXX_WB_SAVED_CLOCKS		20
+
+struct ns9xxx_wb_write {
+	u16			addr;
+	u16			len;
+	u8			buf[NS9XXX_WB_MAX_LEN];
+};
+
+struct ns9xxx_wb_req {
+	struct ns9xxx_xact	xact;
+	struct i2c_msg		msg;
+	struct ns9xxx_wb_write	write;
+};
+
+struct ns9xxx_wb_stats {
+	unsigned long		queued;
+	unsigned long		merged;		/* overwrote a pending write */
+	unsigned long		flushes;
+	unsigned long		failed;
+	unsigned long		coalesced;	/* appended to a pending write */
+	u64			saved_ns;	/* bus time saved by coalescing */
+};
+
+/*
+ * Slave mode backends. ->event() is called from the interrupt handler with
+ * dev_data->lock held, in the order of the Linux I2C slave interface: on a
+ * write from the remote master WRITE_REQUESTED, then WRITE_RECEIVED for each
+ * byte in *val; on a read READ_REQUESTED, then READ_PROCESSED for each byte
+ * after the first, each returning the byte to send in *val; STOP when the
+ * frame has ended.
+ */
+enum ns9xxx_slave_event {
+	NS9XXX_SLAVE_READ_REQUESTED,
+	NS9XXX_SLAVE_WRITE_REQUESTED,
+	NS9XXX_SLAVE_READ_PROCESSED,
+	NS9XXX_SLAVE_WRITE_RECEIVED,
+	NS9XXX_SLAVE_STOP,
+};
+
+struct ns9xxx_slave_ops {
+	const char		*name;
+	int			(*attach)(struct ns9xxx_i2c *dev_data);
+	void			(*detach)(struct ns9xxx_i2c *dev_data);
+	void			(*event)(struct ns9xxx_i2c *dev_data,
+					enum ns9xxx_slave_event event, u8 *val);
+};
+
+/*
+ * Adapter counters, per CPU so that they can be bumped without a lock from
+ * any context; the stats sysfs attribute adds them up. All u64, in the
+ * order of ns9xxx_stat_names[].
+ */
+struct ns9xxx_stats {
+	u64			xfers;		/* transactions started */
+	u64			read_bytes;	/* acknowledged on the bus */
+	u64			write_bytes;
+	u64			nacks;
+	u64			arbitration_lost;
+	u64			timeouts;
+	u64			busy_waits;	/* ns9xxx_wait_while_busy() */
+	u64			reinits;	/* ns9xxx_reinit_i2c() */
+	u64			bitbang_resets;
+	u64			busy_ns;	/* first command to STOP ACK */
+};
+
+/*
+ * Latency histograms, per CPU as well, with log2 buckets: bucket i counts
+ * intervals of 2^(i-1) up to 2^i - 1 ns, the last one everything longer.
+ */
+enum ns9xxx_hist_type {
+	NS9XXX_HIST_XFER,		/* ns9xxx_i2c_xfer() */
+	NS9XXX_HIST_CMD,		/* command written to its interrupt */
+	NS9XXX_HIST_WAKEUP,		/* interrupt to the waiter running */
+	NS9XXX_HIST_RECOVERY,		/* ns9xxx_engine_recover() */
+	NS9XXX_HIST_TYPES
+};
+
+#define NS9XXX_HIST_BUCKETS		32
+
+struct ns9xxx_hist {
+	unsigned long		count[NS9XXX_HIST_TYPES][NS9XXX_HIST_BUCKETS];
+};
+
+/*
+ * Flight recorder: the last NS9XXX_FR_ENTRIES commands and interrupts,
+ * recorded with dev_data->lock held.
+ */
+#define NS9XXX_FR_ENTRIES		64	/* power of two */
+
+#define NS9XXX_FR_CMD			0	/* val: word written to I2C_CMD */
+#define NS9XXX_FR_IRQ			1	/* val: I2C_STATUS read */
+
+#define NS9XXX_FR_NOADDR		0xffff
+
+struct ns9xxx_fr_entry {
+	u64			ts;		/* sched_clock() */
+	u32			val;
+	u16			addr;		/* or NS9XXX_FR_NOADDR */
+	u8			type;
+	u8			phase;		/* engine phase << 4 | state */
+};
+
+struct ns9xxx_fr {
+	struct ns9xxx_fr_entry	e[NS9XXX_FR_ENTRIES];
+	unsigned int		head;		/* next entry */
+};
+
+/*
+ * Capture of what passes through ns9xxx_i2c_xfer(), as a pcap stream or as
+ * transaction records. ns9xxx_i2c_xfer() is serialized by the adapter
+ * lock, so there is one producer and one reader and the byte ring needs no
+ * lock.
+ */
+#define NS9XXX_CAP_SIZE			(256 * 1024)	/* power of two */
+
+enum ns9xxx_cap_format {
+	NS9XXX_CAP_PCAP,
+	NS9XXX_CAP_RECORD,
+};
+
+struct ns9xxx_cap {
+	enum ns9xxx_cap_format	format;
+	u8			*buf;
+	u32			head;		/* written by the producer */
+	u32			tail;		/* written by the reader */
+	u32			dropped;	/* messages or records that did
+						 * not fit */
+	wait_queue_head_t	wait;
+};
+
+#define ns9xxx_stat_add(dev_data, field, n) \
+	irqsafe_cpu_add((dev_data)->stats->field, (n))
+#define ns9xxx_stat_inc(dev_data, field) \
+	ns9xxx_stat_add(dev_data, field, 1)
+
 struct ns9xxx_i2c {
 	struct i2c_adapter	adap;
 	struct resource		*mem;
@@ -118,18 +480,150 @@ struct ns9xxx_i2c {
 	wait_queue_head_t	wait_q;
 
 	struct plat_ns9xxx_i2c	*pdata;
+	struct device		*dev;
+	struct i2c_client	*ara;		/* SMBus alert, or NULL */
 
-	char			*buf;
 	int			irq;
 	enum i2c_int_state	state;
+	unsigned int		bus_freq;
+	u32			masteraddr;	/* last written, or ~0 */
+
+	struct ns9xxx_stats __percpu *stats;
+	struct ns9xxx_hist __percpu *hist;
+	ktime_t			cmd_start;	/* for NS9XXX_HIST_CMD */
+	ktime_t			irq_stamp;	/* of the last synchronous IRQ */
+	struct dentry		*debugfs;
+
+	/* set and cleared with the adapter locked */
+	struct ns9xxx_cap	*cap;
+
+	/* rate limit of bus warnings, see ns9xxx_warn_ratelimit() */
+	spinlock_t		warn_lock;
+	unsigned long		warn_begin;
+	unsigned int		warn_printed;
+	unsigned int		warn_missed;
+	struct timer_list	warn_timer;	/* reports warn_missed */
+
+	/* flight recorder, and its copy from the last timeout or recovery */
+	struct ns9xxx_fr	fr;
+	struct ns9xxx_fr	fr_snap;
+	const char		*fr_snap_reason;	/* NULL if none */
+	u64			fr_snap_ts;
+	u32			fr_snap_status;
+	int			fr_snap_pending;	/* not logged yet */
+
+	/* transaction engine, protected by lock */
+	struct list_head	queue[NS9XXX_QOS_CLASSES];
+	u8			qos_addr[128];	/* class of each 7-bit address */
+	struct ns9xxx_qos_stats	qos_stats[NS9XXX_QOS_CLASSES];
+	u64			queued_ns[NS9XXX_QOS_CLASSES];
+	struct ns9xxx_xact	*cur;
+	struct ns9xxx_xact	*stopping;	/* completed at the STOP ACK */
+	enum ns9xxx_engine_phase phase;
+	wait_queue_head_t	idle_q;
+	struct timer_list	watchdog;
+	struct work_struct	recover_work;
+	struct hrtimer		ackpoll_timer;
+	ktime_t			busy_start;	/* of the current transaction */
+
+	/* read cache, protected by lock */
+	struct ns9xxx_cache_entry cache[NS9XXX_CACHE_ENTRIES];
+	int			cache_rules;
+
+	/* write-behind, pending writes and stats protected by wb_lock */
+	u8			wb_addr[128];	/* NS9XXX_WB_* of 7-bit addresses */
+	struct mutex		wb_lock;
+	struct ns9xxx_wb_write	wb_pending[NS9XXX_WB_ENTRIES];
+	int			wb_npending;
+	struct ns9xxx_wb_stats	wb_stats;
+	struct mutex		wb_flush_lock;	/* protects wb_reqs */
+	struct ns9xxx_wb_req	wb_reqs[NS9XXX_WB_ENTRIES];
+	struct delayed_work	wb_work;
+
+	/* slave mode, slave and slave_priv set under slave_lock and lock */
+	struct mutex		slave_lock;
+	const struct ns9xxx_slave_ops *slave;
+	void			*slave_priv;
+	u16			slave_addr;
+	int			slave_frame;	/* inside a frame */
+	struct hrtimer		slave_timer;
+
+	/* slave mailbox, ring and owner set under slave_lock */
+	struct file		*mbox_owner;	/* file that attached it */
+	struct ns9xxx_ring	mbox_ring;
+	struct ns9xxx_i2c_frame	*mbox_cur;	/* frame being received */
+	wait_queue_head_t	mbox_wait;
+
+	/* character device */
+	struct list_head	node;
+	struct miscdevice	miscdev;
+	char			miscname[20];
+	struct mutex		ioctl_lock;
+	struct kref		ref;		/* probe and every open file */
+	int			dead;		/* removed, files still open */
+
+	struct ns9xxx_sampler	sampler;
+};
+
+/* submission/completion queue pair of an open file */
+struct ns9xxx_queue;
+
+struct ns9xxx_queue_req {
+	struct ns9xxx_xact	xact;		/* xact.list links free requests */
+	struct i2c_msg		msgs[NS9XXX_I2C_SQE_MAX_MSGS];
+	u64			user_data;
+	struct ns9xxx_queue	*queue;
+};
+
+struct ns9xxx_queue {
+	struct ns9xxx_ring	sq;
+	struct ns9xxx_ring	cq;
+	u8			*data;
+	u32			data_size;
+	unsigned long		data_mapsize;
+
+	/* protected by dev_data->lock */
+	struct ns9xxx_queue_req	*reqs;
+	struct list_head	free;
+	int			inflight;
+
+	wait_queue_head_t	wait;
+	struct eventfd_ctx	*eventfd;
+};
+
+#define NS9XXX_QUEUE_MAX_DATA		(1 << 20)
+
+struct ns9xxx_script {
+	struct ns9xxx_i2c_insn	*insns;
+	u32			ninsns;
+};
+
+/* instructions executed per run, catches endless loops */
+#define NS9XXX_SCRIPT_MAX_STEPS		4096
+
+struct ns9xxx_i2c_file {
+	struct ns9xxx_i2c	*dev_data;
+	struct mutex		lock;
+	struct ns9xxx_queue	*queue;
+	struct ns9xxx_script	scripts[NS9XXX_I2C_SCRIPT_SLOTS];
 };
 
+static LIST_HEAD(ns9xxx_i2c_devices);
+static DEFINE_MUTEX(ns9xxx_i2c_devices_lock);
+
 static int ns9xxx_i2c_xfer(struct i2c_adapter *adap,
 		struct i2c_msg msgs[], int num);
+static void ns9xxx_i2c_free(struct kref *ref);
+static void ns9xxx_cache_invalidate(struct ns9xxx_i2c *dev_data,
+		const struct ns9xxx_xact *xact);
 
 static u32 ns9xxx_i2c_func(struct i2c_adapter *adap)
 {
+	/* of the mangling flags only I2C_M_IGNORE_NAK can be done */
 	return I2C_FUNC_I2C | I2C_FUNC_10BIT_ADDR
+#ifdef I2C_FUNC_NOSTART
+		| I2C_FUNC_NOSTART
+#endif
 		| I2C_FUNC_SMBUS_QUICK | I2C_FUNC_SMBUS_BYTE
 		| I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA;
 }
@@ -141,7 +635,232 @@ static struct i2c_algorithm ns9xxx_i2c_algo = {
 
 static int ns9xxx_i2c_set_clock(struct ns9xxx_i2c *dev_data, unsigned int freq);
 static int ns9xxx_wait_while_busy(struct ns9xxx_i2c *dev);
+static void ns9xxx_engine_irq(struct ns9xxx_i2c *dev_data, u32 status);
+static void ns9xxx_slave_irq(struct ns9xxx_i2c *dev_data, u32 status);
+static void ns9xxx_cap_xfer(struct ns9xxx_i2c *dev_data, ktime_t ts,
+		const struct i2c_msg *msgs, int num, int ret);
+
+
+/*
+ * Histograms are only filled while hist_enabled, in debugfs, is set; the
+ * check is all they cost otherwise.
+ */
+static u32 ns9xxx_hist_enabled __read_mostly;
+static struct dentry *ns9xxx_debugfs;
+
+/* start of an interval, 0 while histograms are off */
+static ktime_t ns9xxx_hist_start(void)
+{
+	return ns9xxx_hist_enabled ? ktime_get() : ktime_set(0, 0);
+}
+
+static void ns9xxx_hist_add(struct ns9xxx_i2c *dev_data,
+		enum ns9xxx_hist_type type, s64 ns)
+{
+	int bucket = ns > 0 ? fls64(ns) : 0;
+
+	if (bucket >= NS9XXX_HIST_BUCKETS)
+		bucket = NS9XXX_HIST_BUCKETS - 1;
+
+	irqsafe_cpu_inc(dev_data->hist->count[type][bucket]);
+}
+
+/* account the interval from start to now, if it was started */
+static void ns9xxx_hist_end(struct ns9xxx_i2c *dev_data,
+		enum ns9xxx_hist_type type, ktime_t start)
+{
+	if (!ns9xxx_hist_enabled || !ktime_to_ns(start))
+		return;
+
+	ns9xxx_hist_add(dev_data, type,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+/*
+ * A stuck bus fails every byte and every recovery attempt, and printing
+ * all of that on a serial console only makes it worse: bus warnings come in
+ * bursts of NS9XXX_WARN_BURST per NS9XXX_WARN_INTERVAL, with the number
+ * held back reported by warn_timer when the interval ends. Details are in
+ * dev_dbg() and the tracepoints.
+ */
+#define NS9XXX_WARN_INTERVAL		(5 * HZ)
+#define NS9XXX_WARN_BURST		10
+
+static int ns9xxx_warn_ratelimit(struct ns9xxx_i2c *dev_data)
+{
+	unsigned long flags;
+	unsigned int missed = 0;
+	int ret = 0;
+
+	spin_lock_irqsave(&dev_data->warn_lock, flags);
+	if (time_after(jiffies, dev_data->warn_begin + NS9XXX_WARN_INTERVAL)) {
+		missed = dev_data->warn_missed;
+		dev_data->warn_begin = jiffies;
+		dev_data->warn_printed = 0;
+		dev_data->warn_missed = 0;
+	}
+	if (dev_data->warn_printed < NS9XXX_WARN_BURST) {
+		dev_data->warn_printed++;
+		ret = 1;
+	} else if (!dev_data->warn_missed++) {
+		/* report them at the end of the interval, even if all is quiet */
+		mod_timer(&dev_data->warn_timer,
+				dev_data->warn_begin + NS9XXX_WARN_INTERVAL + 1);
+	}
+	spin_unlock_irqrestore(&dev_data->warn_lock, flags);
+
+	if (missed)
+		dev_warn(dev_data->dev, "%u bus warnings suppressed\n", missed);
+
+	return ret;
+}
+
+static void ns9xxx_warn_timer(unsigned long data)
+{
+	struct ns9xxx_i2c *dev_data = (struct ns9xxx_i2c *)data;
+	unsigned long flags;
+	unsigned int missed;
+
+	spin_lock_irqsave(&dev_data->warn_lock, flags);
+	missed = dev_data->warn_missed;
+	dev_data->warn_missed = 0;
+	spin_unlock_irqrestore(&dev_data->warn_lock, flags);
+
+	if (missed)
+		dev_warn(dev_data->dev, "%u bus warnings suppressed\n", missed);
+}
+
+#define ns9xxx_warn(dev_data, fmt, args...)				\
+	do {								\
+		if (ns9xxx_warn_ratelimit(dev_data))			\
+			dev_warn((dev_data)->dev, fmt, ##args);		\
+	} while (0)
+
+#define ns9xxx_err(dev_data, fmt, args...)				\
+	do {								\
+		if (ns9xxx_warn_ratelimit(dev_data))			\
+			dev_err((dev_data)->dev, fmt, ##args);		\
+	} while (0)
+
+/*
+ * Address of the engine transaction on the bus. I2C_MASTERADDR still holds
+ * it for the STOP after dev_data->cur is gone; ns9xxx_i2c_send_cmd() users
+ * do not go through the cache, so their traffic has no known address.
+ */
+static u16 ns9xxx_fr_addr(struct ns9xxx_i2c *dev_data)
+{
+	const struct ns9xxx_xact *xact = dev_data->cur;
+
+	if (dev_data->phase == NS9XXX_PHASE_SYNC)
+		return NS9XXX_FR_NOADDR;
+	if (xact)
+		return xact->msgs[xact->msg].addr;
+	if (dev_data->phase == NS9XXX_PHASE_STOP && dev_data->masteraddr != ~0)
+		return (dev_data->masteraddr >> I2C_MASTERADDR_ADDRSHIFT) &
+			I2C_MASTERADDR_ADDRMASK;
+
+	return NS9XXX_FR_NOADDR;
+}
+
+static void ns9xxx_fr_record(struct ns9xxx_i2c *dev_data, u8 type, u32 val)
+{
+	struct ns9xxx_fr_entry *e =
+		&dev_data->fr.e[dev_data->fr.head++ & (NS9XXX_FR_ENTRIES - 1)];
+
+	e->ts = sched_clock();
+	e->val = val;
+	e->addr = ns9xxx_fr_addr(dev_data);
+	e->type = type;
+	e->phase = (dev_data->phase << 4) | (dev_data->state & 0xf);
+}
+
+/*
+ * Keep a copy of the recorder for debugfs and the log, with dev_data->lock
+ * held. The first cause wins until it has been logged.
+ */
+static void ns9xxx_fr_snapshot(struct ns9xxx_i2c *dev_data,
+		const char *reason)
+{
+	if (dev_data->fr_snap_pending)
+		return;
+
+	dev_data->fr_snap = dev_data->fr;
+	dev_data->fr_snap_reason = reason;
+	dev_data->fr_snap_ts = sched_clock();
+	dev_data->fr_snap_status = readl(dev_data->ioaddr + I2C_STATUS);
+	dev_data->fr_snap_pending = 1;
+}
+
+static void ns9xxx_fr_entry_str(const struct ns9xxx_fr_entry *e, char *buf,
+		size_t len)
+{
+	u64 ts = e->ts;
+	unsigned long ns = do_div(ts, NSEC_PER_SEC);
+	char addr[6] = "  -  ";
+
+	if (e->addr != NS9XXX_FR_NOADDR)
+		snprintf(addr, sizeof(addr), "0x%03x", e->addr);
+
+	snprintf(buf, len, "%5lu.%06lu %s 0x%08x addr %s phase %u state %u",
+			(unsigned long)ts, ns / NSEC_PER_USEC,
+			e->type == NS9XXX_FR_CMD ? "cmd" : "irq", e->val,
+			addr, e->phase >> 4, e->phase & 0xf);
+}
+
+/*
+ * Log a pending snapshot; process context. A bus that keeps failing would
+ * flood the console with whole dumps, so only one rate-limited line goes
+ * out, with the last command and interrupt; the entries, oldest first, are
+ * left to dev_dbg() and the flight_recorder file in debugfs.
+ */
+static void ns9xxx_fr_report(struct ns9xxx_i2c *dev_data)
+{
+	const struct ns9xxx_fr_entry *e, *cmd = NULL, *irq = NULL;
+	struct ns9xxx_fr *fr;
+	const char *reason;
+	unsigned long flags;
+	unsigned int i, n;
+	u32 status;
+	char line[80];
+
+	if (!dev_data->fr_snap_pending)
+		return;
+
+	fr = kmalloc(sizeof(*fr), GFP_KERNEL);
+	if (!fr)
+		return;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	n = dev_data->fr_snap_pending;
+	dev_data->fr_snap_pending = 0;
+	*fr = dev_data->fr_snap;
+	reason = dev_data->fr_snap_reason;
+	status = dev_data->fr_snap_status;
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	if (!n || !ns9xxx_warn_ratelimit(dev_data))
+		goto out;
+
+	n = min_t(unsigned int, fr->head, NS9XXX_FR_ENTRIES);
+	for (i = fr->head; i != fr->head - n && (!cmd || !irq); i--) {
+		e = &fr->e[(i - 1) & (NS9XXX_FR_ENTRIES - 1)];
+		if (e->type == NS9XXX_FR_CMD && !cmd)
+			cmd = e;
+		else if (e->type == NS9XXX_FR_IRQ && !irq)
+			irq = e;
+	}
+
+	dev_warn(dev_data->dev, "%s, STATUS 0x%08x, last cmd 0x%08x, last irq 0x%08x\n",
+			reason, status, cmd ? cmd->val : 0, irq ? irq->val : 0);
 
+	for (i = fr->head - n; i != fr->head; i++) {
+		ns9xxx_fr_entry_str(&fr->e[i & (NS9XXX_FR_ENTRIES - 1)],
+				line, sizeof(line));
+		dev_dbg(dev_data->dev, "  %s\n", line);
+	}
+out:
+	kfree(fr);
+}
 
 static irqreturn_t ns9xxx_i2c_irq(int irqnr, void *dev_id)
 {
@@ -150,16 +869,31 @@ static irqreturn_t ns9xxx_i2c_irq(int irqnr, void *dev_id)
 
 	/* acknowledge IRQ by reading the status register */
 	status = readl(dev_data->ioaddr + I2C_STATUS);
+	trace_i2c_ns9xxx_irq(dev_data->adap.nr, status);
+
+	spin_lock(&dev_data->lock);
 
-	if (dev_data->state != I2C_INT_AWAITING)
+	ns9xxx_fr_record(dev_data, NS9XXX_FR_IRQ, status);
+
+	if ((status & I2C_STATUS_IRQCD_MASK) >= I2C_IRQ_S_RXABORT) {
+		ns9xxx_slave_irq(dev_data, status);
+		spin_unlock(&dev_data->lock);
 		return IRQ_HANDLED;
+	}
+
+	if (dev_data->phase != NS9XXX_PHASE_SYNC) {
+		ns9xxx_engine_irq(dev_data, status);
+		spin_unlock(&dev_data->lock);
+		return IRQ_HANDLED;
+	}
+
+	if (dev_data->state != I2C_INT_AWAITING) {
+		spin_unlock(&dev_data->lock);
+		return IRQ_HANDLED;
+	}
 
-	spin_lock(&dev_data->lock);
-	
 	switch (status & I2C_STATUS_IRQCD_MASK) {
 	case I2C_IRQ_RXDATA:
-		if (dev_data->buf)
-			*dev_data->buf = status & I2C_STATUS_RXDATA_MASK;
 	case I2C_IRQ_CMDACK:
 	case I2C_IRQ_TXDATA:
 		dev_data->state = I2C_INT_OK;
@@ -167,14 +901,18 @@ static irqreturn_t ns9xxx_i2c_irq(int irqnr, void *dev_id)
 	case I2C_IRQ_NOACK:
 		writel(I2C_CMD_STOP, dev_data->ioaddr + I2C_CMD);
 		dev_data->state = I2C_INT_ABORT;
+		ns9xxx_stat_inc(dev_data, nacks);
 		break;
 	case I2C_IRQ_ARBITLOST:
 		dev_data->state = I2C_INT_RETRY;
+		ns9xxx_stat_inc(dev_data, arbitration_lost);
 		break;
 	default:
 		dev_data->state = I2C_INT_ERROR;
 	}
 
+	dev_data->irq_stamp = ns9xxx_hist_start();
+
 	spin_unlock(&dev_data->lock);
 
 	wake_up_interruptible(&dev_data->wait_q);
@@ -185,28 +923,40 @@ static irqreturn_t ns9xxx_i2c_irq(int irqnr, void *dev_id)
 static int ns9xxx_i2c_send_cmd(struct ns9xxx_i2c *dev_data, unsigned int cmd)
 {
 	unsigned long flags;
+	ktime_t start;
 	u32 status;
 		
 	status = readl(dev_data->ioaddr + I2C_STATUS);
 	if (status & I2C_STATUS_MCMDL) {
 		if (ns9xxx_wait_while_busy(dev_data)) {		/* Wait for previous command to finish */
-			printk(KERN_WARNING "NS9XXX I2C: timeout waiting for I2C master module to unlock\n");
+			ns9xxx_warn(dev_data, "timeout waiting for I2C master module to unlock\n");
 			return -ETIMEDOUT;
 		}
 	}
 	
 	spin_lock_irqsave(&dev_data->lock, flags);
 	dev_data->state = I2C_INT_AWAITING;
+	dev_data->irq_stamp = ktime_set(0, 0);
+	start = ns9xxx_hist_start();
+	trace_i2c_ns9xxx_cmd(dev_data->adap.nr, cmd);
+	ns9xxx_fr_record(dev_data, NS9XXX_FR_CMD, cmd);
 	writel(cmd, dev_data->ioaddr + I2C_CMD);
 	spin_unlock_irqrestore(&dev_data->lock, flags);
 	
 	if (!wait_event_interruptible_timeout(dev_data->wait_q,
 				dev_data->state != I2C_INT_AWAITING,
 				dev_data->adap.timeout)) {
-		printk(KERN_WARNING "NS9XXX I2C: timeout waiting for interrupt (cmd = %u, timeout = %d)\n", cmd, (int)(dev_data->adap.timeout));
+		ns9xxx_warn(dev_data, "timeout waiting for interrupt (cmd = %u, timeout = %d)\n", cmd, (int)(dev_data->adap.timeout));
+		trace_i2c_ns9xxx_timeout(dev_data->adap.nr, -1, cmd);
+		ns9xxx_stat_inc(dev_data, timeouts);
+
+		spin_lock_irqsave(&dev_data->lock, flags);
+		ns9xxx_fr_snapshot(dev_data, "command timeout");
+		spin_unlock_irqrestore(&dev_data->lock, flags);
+		ns9xxx_fr_report(dev_data);
 		
 		if (ns9xxx_wait_while_busy(dev_data) == 0) {
-			printk(KERN_WARNING "NS9XXX I2C: bus seems free after waiting, but not retrying.\n");
+			dev_dbg(dev_data->dev, "bus seems free after waiting, but not retrying.\n");
 			
 			#if 0
 			// If bus is free, see if we can repeat the command
@@ -229,48 +979,21 @@ static int ns9xxx_i2c_send_cmd(struct ns9xxx_i2c *dev_data, unsigned int cmd)
 		return -ETIMEDOUT;
 	}
 
+	if (ktime_to_ns(start) && ktime_to_ns(dev_data->irq_stamp)) {
+		ns9xxx_hist_add(dev_data, NS9XXX_HIST_CMD, ktime_to_ns(
+				ktime_sub(dev_data->irq_stamp, start)));
+		ns9xxx_hist_end(dev_data, NS9XXX_HIST_WAKEUP,
+				dev_data->irq_stamp);
+	}
+
 	if (dev_data->state != I2C_INT_OK) {
-		printk(KERN_WARNING "NS9XXX I2C: state %d != I2C_INT_OK in ns9xxx_i2c_send_cmd()\n", dev_data->state);
+		dev_dbg(dev_data->dev, "state %d != I2C_INT_OK in ns9xxx_i2c_send_cmd()\n", dev_data->state);
 		return -EIO;
 	}
 	
 	return 0;
 }
 
-static int ns9xxx_i2c_read(struct ns9xxx_i2c *dev_data, int count)
-{
-	unsigned long flags;
-	int ret = 0;
-
-	while (count-- > 1) {
-		spin_lock_irqsave(&dev_data->lock, flags);
-		dev_data->buf++;
-		spin_unlock_irqrestore(&dev_data->lock, flags);
-
-		ret = ns9xxx_i2c_send_cmd(dev_data, I2C_CMD_NOP);
-		if (ret)
-			break;
-	}
-
-	return ret;
-}
-
-static int ns9xxx_i2c_write(struct ns9xxx_i2c *dev_data,
-		const char *buf, int count)
-{
-	int ret = 0;
-
-	while (count--) {
-		ret = ns9xxx_i2c_send_cmd(dev_data,
-				I2C_CMD_NOP | I2C_CMD_TXVAL | *buf);
-		if (ret)
-			break;
-		buf++;
-	}
-
-	return ret;
-}
-
 static int ns9xxx_i2c_bitbang(struct ns9xxx_i2c *dev_data, struct i2c_msg *msg)
 {
 	int i, nr_bits, ret;
@@ -288,7 +1011,6 @@ static int ns9xxx_i2c_bitbang(struct ns9xxx_i2c *dev_data, struct i2c_msg *msg)
 	mdelay(1);
 
 	nr_bits = (msg->flags & I2C_M_TEN) ? 10 : 7;
-	printk(KERN_DEBUG "NS9XXX I2C: sending %d bits using bitbang-routine\n", nr_bits);
 	for (i = 0; i < nr_bits; i++) {
 		/* set data */
 		if (msg->addr & (1 << (nr_bits - i - 1)))
@@ -341,10 +1063,13 @@ static void ns9xxx_i2c_reset_bitbang(struct ns9xxx_i2c *dev_data)
 {
 	// Use GPIO to force a bus-reset
 	
-	int i, scl, sda, prev_sda;
+	int i, scl, sda;
 	u32 status, masteraddr, config;
 	int effective_cycles = 0;
 	
+	ns9xxx_stat_inc(dev_data, bitbang_resets);
+	trace_i2c_ns9xxx_recovery(dev_data->adap.nr, NS9XXX_RECOVERY_BITBANG, 0);
+
 	disable_irq(dev_data->irq);		/* Disable our interrupt for a while */	
 	
 	gpio_direction_input(dev_data->pdata->gpio_scl);
@@ -352,36 +1077,22 @@ static void ns9xxx_i2c_reset_bitbang(struct ns9xxx_i2c *dev_data)
 	mdelay(1);
 	scl = gpio_get_value(dev_data->pdata->gpio_scl);
 	sda = gpio_get_value(dev_data->pdata->gpio_sda);
+	trace_i2c_ns9xxx_bitbang(dev_data->adap.nr, 0, scl, sda);
 
-	if (sda && scl) {
-		printk(KERN_DEBUG "NS9XXX I2C: bus-reset requested but bus seems idle, reset not needed?\n");
-	}
-	
-	if (!sda) {
-		printk(KERN_DEBUG "NS9XXX I2C: SDA seems to be held low externally.\n");
-	}
-	
-	prev_sda = sda;
-	
 	for (i = 0; i < 9; i++) {
 		/* toggle clock */
 
 		scl = gpio_get_value(dev_data->pdata->gpio_scl);
-		if (!scl) {
-			printk(KERN_DEBUG "NS9XXX I2C: SCL held low at start of clock cycle %d, continuing anyway.\n", i);
-		} else
+		if (scl)
 			effective_cycles++;
 		gpio_direction_output(dev_data->pdata->gpio_scl, 0);
 		mdelay(1);
 		gpio_direction_input(dev_data->pdata->gpio_scl);
 		sda = gpio_get_value(dev_data->pdata->gpio_sda);
 		scl = gpio_get_value(dev_data->pdata->gpio_scl);
-		if (sda != prev_sda) {
-			printk(KERN_DEBUG "NS9XXX I2C: SDA changed from %d to %d after %d clock cycles.\n", prev_sda, sda, i);
-			prev_sda = sda;
-		}
+		trace_i2c_ns9xxx_bitbang(dev_data->adap.nr, i + 1, scl, sda);
 		if (!scl) {
-			printk(KERN_DEBUG "NS9XXX I2C: SCL held low at end of clock cycle %d, 1 ms delay.\n", i);
+			/* held low at the end of the cycle, give it time */
 			mdelay(1);
 		}
 	}
@@ -393,19 +1104,17 @@ static void ns9xxx_i2c_reset_bitbang(struct ns9xxx_i2c *dev_data)
 	mdelay(1);
 	scl = gpio_get_value(dev_data->pdata->gpio_scl);
 	sda = gpio_get_value(dev_data->pdata->gpio_sda);
+	trace_i2c_ns9xxx_bitbang(dev_data->adap.nr, 10, scl, sda);
 	
 	if (scl == 0) {
-		printk(KERN_ERR "NS9XXX I2C: SCL seems to be held low externally?\n");
+		ns9xxx_err(dev_data, "SCL seems to be held low externally?\n");
 	}
 	if (sda == 0) {
-		printk(KERN_ERR "NS9XXX I2C: SDA seems to be held low externally?\n");
+		ns9xxx_err(dev_data, "SDA seems to be held low externally?\n");
 	}
 	
-	if (scl && sda) {
-		printk(KERN_DEBUG "NS9XXX I2C: reset successful, bus seems to be idle\n");
-	} else {
-		printk(KERN_DEBUG "NS9XXX I2C: reset unsuccessful after %d effective cycles\n", effective_cycles);
-	}
+	trace_i2c_ns9xxx_recovery(dev_data->adap.nr,
+			NS9XXX_RECOVERY_BITBANG_DONE, effective_cycles);
 	
 	/* reset gpios to hardware i2c */
 	dev_data->pdata->gpio_configuration_func();
@@ -413,7 +1122,7 @@ static void ns9xxx_i2c_reset_bitbang(struct ns9xxx_i2c *dev_data)
 	status = readl(dev_data->ioaddr + I2C_STATUS);
 	masteraddr = readl(dev_data->ioaddr + I2C_MASTERADDR);
 	config = readl(dev_data->ioaddr + I2C_CONFIG);
-	printk(KERN_WARNING "NS9XXX I2C: STATUS %lx, MASTERADDR %lx, CONFIG %lx, state %lx\n", (unsigned long)status, (unsigned long)masteraddr, (unsigned long)config, (unsigned long)dev_data->state);
+	dev_dbg(dev_data->dev, "STATUS %lx, MASTERADDR %lx, CONFIG %lx, state %lx\n", (unsigned long)status, (unsigned long)masteraddr, (unsigned long)config, (unsigned long)dev_data->state);
 
 	enable_irq(dev_data->irq);		/* Reenable our interrupt */
 }
@@ -424,6 +1133,8 @@ static void ns9xxx_reinit_i2c(struct ns9xxx_i2c *dev_data)
 	u32 status;
 	int ret;
 	
+	ns9xxx_stat_inc(dev_data, reinits);
+
 	ns9xxx_i2c_reset_bitbang(dev_data);		/* Try to reset the bus */
 
 	status = readl(dev_data->ioaddr + I2C_STATUS);
@@ -431,7 +1142,9 @@ static void ns9xxx_reinit_i2c(struct ns9xxx_i2c *dev_data)
 	
 		/* Master module still locked, try to reinitialise the I2C hardware */
 		
-		printk(KERN_WARNING "NS9XXX I2C: master module still locked (STATUS 0x%lx), trying to reinitialise hardware\n", (unsigned long)status);
+		ns9xxx_warn(dev_data, "master module still locked (STATUS 0x%lx), trying to reinitialise hardware\n", (unsigned long)status);
+		trace_i2c_ns9xxx_recovery(dev_data->adap.nr,
+				NS9XXX_RECOVERY_HW_REINIT, status);
 		
 		disable_irq(dev_data->irq);
 		
@@ -443,16 +1156,16 @@ static void ns9xxx_reinit_i2c(struct ns9xxx_i2c *dev_data)
 		else
 			ret = ns9xxx_i2c_set_clock(dev_data, I2C_NORMALSPEED);
 		if (ret) {
-			printk(KERN_ERR "NS9XXX I2C: Error setting bus clock\n");
+			dev_err(dev_data->dev, "Error setting bus clock\n");
 		}
 		
 		enable_irq(dev_data->irq);
 		
 		writel(readl(dev_data->ioaddr + I2C_CONFIG) & ~I2C_CONFIG_IRQD,
 			dev_data->ioaddr + I2C_CONFIG);	
-	} else {
-		printk(KERN_DEBUG "NS9XXX I2C: master module idle (STATUS 0x%lx)\n", (unsigned long)status);
-	}
+	} else
+		trace_i2c_ns9xxx_recovery(dev_data->adap.nr,
+				NS9XXX_RECOVERY_UNLOCKED, status);
 }
 
 
@@ -469,10 +1182,14 @@ static int ns9xxx_wait_while_busy(struct ns9xxx_i2c *dev)
 	unsigned long timeout;
 	int i, status;
 
+	ns9xxx_stat_inc(dev, busy_waits);
+
 	status = readl(dev->ioaddr + I2C_STATUS);
 	if ((status & I2C_STATUS_MCMDL) == 0)
 		return 0;								// Module is free to receive commands
 	
+	trace_i2c_ns9xxx_recovery(dev->adap.nr, NS9XXX_RECOVERY_WAIT_BUSY, status);
+
 	// Module seems to be locked
 	
 	for (i = 0; i < BUSY_RELEASE_ATTEMPTS; i++) {
@@ -484,120 +1201,3825 @@ static int ns9xxx_wait_while_busy(struct ns9xxx_i2c *dev)
 			if ((status & I2C_STATUS_MCMDL) == 0) {
 				msleep(1);
 				status = readl(dev->ioaddr + I2C_STATUS);
-				printk(KERN_DEBUG "NS9XXX I2C: master module idle (STATUS 0x%lx)\n", (unsigned long)status);
+				trace_i2c_ns9xxx_recovery(dev->adap.nr,
+						NS9XXX_RECOVERY_UNLOCKED, status);
 				return 0;
 			}
 			msleep(1);
 		}
 
-		printk(KERN_WARNING "transaction timed out waiting for device to be free (not busy). Attempt: %d\n", i+1);
+		dev_dbg(dev->dev, "transaction timed out waiting for device to be free (not busy). Attempt: %d\n", i+1);
+		trace_i2c_ns9xxx_recovery(dev->adap.nr, NS9XXX_RECOVERY_REINIT,
+				i + 1);
 		
 		ns9xxx_reinit_i2c(dev);
 	}
 
-	printk(KERN_ERR "giving up after %d attempts to reset the bus.\n",  BUSY_RELEASE_ATTEMPTS);
+	ns9xxx_err(dev, "giving up after %d attempts to reset the bus.\n",  BUSY_RELEASE_ATTEMPTS);
+	trace_i2c_ns9xxx_recovery(dev->adap.nr, NS9XXX_RECOVERY_GIVE_UP,
+			BUSY_RELEASE_ATTEMPTS);
 
 	return -ETIMEDOUT;	
 }
 
 
-static int ns9xxx_i2c_xfer(struct i2c_adapter *adap,
-		struct i2c_msg msgs[], int num)
+static void ns9xxx_i2c_unstick(struct ns9xxx_i2c *dev_data)
 {
-	struct ns9xxx_i2c *dev_data = (struct ns9xxx_i2c *)adap->algo_data;
-	int len, i, ret = 0, retry = 10;
-	unsigned long flags = 0;
-	unsigned int cmd, reg;
-	char *buf = NULL;
+	if (ns9xxx_i2c_send_cmd(dev_data, I2C_CMD_STOP)) {
+		ns9xxx_warn(dev_data, "interface seems to be stuck, trying to unlock (state %lx)\n", (unsigned long)dev_data->state);
+		trace_i2c_ns9xxx_recovery(dev_data->adap.nr,
+				NS9XXX_RECOVERY_UNSTICK, dev_data->state);
+		/* sometimes interface gets stucked
+		 * try to fix this by send "start, nop, start" */
+		ns9xxx_i2c_send_cmd(dev_data, I2C_CMD_NOP);
+		if (ns9xxx_i2c_send_cmd(dev_data, I2C_CMD_STOP)) {
+			ns9xxx_warn(dev_data, "interface still stuck, forcing bus-reset using GPIO\n");
+			ns9xxx_i2c_reset_bitbang(dev_data);
+		}
+	}
+}
 
-	dev_data->state = I2C_INT_OK;
 
-	for (i = 0; i < num; i++) {
-		if (dev_data->state == I2C_INT_RETRY) {
-			ret = ns9xxx_i2c_send_cmd(dev_data, I2C_CMD_STOP);
-			--retry;
-			if (ret || !retry)
-				return -EIO;
-		}
+/*
+ * Transaction engine
+ *
+ * Transactions are queued on dev_data->queue[] and executed by the interrupt
+ * handler, which issues the next command as soon as the previous one is
+ * acknowledged. A transaction with a deadline is failed with -ETIME when it
+ * is queued if the estimated bus time of it and everything ahead of it
+ * would not fit, and stopped at the next byte if the deadline passes. The
+ * submitter is completed after the last data byte, so it can return while
+ * the STOP is still on the bus; when that STOP is acknowledged, the next
+ * queued transaction starts from the same interrupt. The watchdog timer
+ * catches commands that never complete and hands the controller to
+ * recover_work, which uses the synchronous ns9xxx_i2c_send_cmd() path to
+ * unlock the bus.
+ *
+ * All ns9xxx_engine_* functions below, except submit, claim and release,
+ * are called with dev_data->lock held.
+ */
 
-		len = msgs[i].len;
-		buf = msgs[i].buf;
+/* bus time of a transaction: 9 clocks per byte, START, STOP */
+static u64 ns9xxx_wire_ns(struct ns9xxx_i2c *dev_data,
+		const struct i2c_msg *msgs, int num)
+{
+	u64 clocks = 1;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		clocks += 9 * msgs[i].len;
+		if (!(msgs[i].flags & I2C_M_NOSTART))
+			clocks += 1 + 9 * ((msgs[i].flags & I2C_M_TEN) ? 2 : 1);
+	}
+
+	return div_u64(clocks * NSEC_PER_SEC, dev_data->bus_freq);
+}
+
+static int ns9xxx_engine_expired(const struct ns9xxx_xact *xact)
+{
+	return xact->deadline && ktime_to_ns(ktime_get()) >= xact->deadline;
+}
+
+static void ns9xxx_engine_cmd(struct ns9xxx_i2c *dev_data, unsigned int cmd)
+{
+	mod_timer(&dev_data->watchdog, jiffies + dev_data->adap.timeout);
+	dev_data->cmd_start = ns9xxx_hist_start();
+	trace_i2c_ns9xxx_cmd(dev_data->adap.nr, cmd);
+	ns9xxx_fr_record(dev_data, NS9XXX_FR_CMD, cmd);
+	writel(cmd, dev_data->ioaddr + I2C_CMD);
+}
+
+static void ns9xxx_engine_set_phase(struct ns9xxx_i2c *dev_data,
+		enum ns9xxx_engine_phase phase)
+{
+	trace_i2c_ns9xxx_phase(dev_data->adap.nr, dev_data->phase, phase);
+	dev_data->phase = phase;
+}
+
+/* clock the next byte of the current message */
+static void ns9xxx_engine_next_byte(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_xact *xact = dev_data->cur;
+	struct i2c_msg *msg = &xact->msgs[xact->msg];
+
+	if (msg->flags & I2C_M_RD)
+		ns9xxx_engine_cmd(dev_data, I2C_CMD_NOP);
+	else
+		ns9xxx_engine_cmd(dev_data,
+				I2C_CMD_NOP | I2C_CMD_TXVAL | msg->buf[xact->pos]);
+}
+
+static u32 ns9xxx_engine_masteraddr(const struct i2c_msg *msg)
+{
+	u32 reg;
+
+	reg = ((msg->addr & I2C_MASTERADDR_ADDRMASK)
+			<< I2C_MASTERADDR_ADDRSHIFT);
+	if (msg->flags & I2C_M_TEN)
+		reg |= I2C_MASTERADDR_10BIT;
+	else
+		reg |= I2C_MASTERADDR_7BIT;
+
+	return reg;
+}
+
+/* set device address, unless it is already there */
+static void ns9xxx_engine_set_addr(struct ns9xxx_i2c *dev_data, u32 reg)
+{
+	if (reg == dev_data->masteraddr)
+		return;
+
+	writel(reg, dev_data->ioaddr + I2C_MASTERADDR);
+	dev_data->masteraddr = reg;
+}
+
+static void ns9xxx_engine_start_msg(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_xact *xact = dev_data->cur;
+	struct i2c_msg *msg = &xact->msgs[xact->msg];
+
+	xact->pos = 0;
+
+	if (xact->flags & NS9XXX_XACT_REGREAD) {
+		ns9xxx_engine_set_addr(dev_data, xact->masteraddr);
+		ns9xxx_engine_cmd(dev_data, xact->cmd[xact->msg]);
+		return;
+	}
+
+	/* the first message of a transaction always gets its START */
+	if ((msg->flags & I2C_M_NOSTART) && xact->msg != xact->first) {
+		ns9xxx_engine_next_byte(dev_data);
+		return;
+	}
+
+	ns9xxx_engine_set_addr(dev_data, ns9xxx_engine_masteraddr(msg));
+
+	if (msg->flags & I2C_M_RD)
+		ns9xxx_engine_cmd(dev_data, I2C_CMD_READ);
+	else
+		ns9xxx_engine_cmd(dev_data,
+				I2C_CMD_WRITE | I2C_CMD_TXVAL | msg->buf[0]);
+}
+
+/* first transaction queued in a class below (more urgent than) limit */
+static struct ns9xxx_xact *ns9xxx_engine_next(struct ns9xxx_i2c *dev_data,
+		int limit)
+{
+	int i;
+
+	for (i = 0; i < limit; i++)
+		if (!list_empty(&dev_data->queue[i]))
+			return list_first_entry(&dev_data->queue[i],
+					struct ns9xxx_xact, list);
+
+	return NULL;
+}
+
+static void ns9xxx_qos_account(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_xact *xact, ktime_t now)
+{
+	struct ns9xxx_qos_stats *stats = &dev_data->qos_stats[xact->prio];
+	u64 delay = ktime_to_ns(ktime_sub(now, xact->queued));
+
+	if (!xact->first)
+		stats->count++;
+	stats->total_ns += delay;
+	if (delay > stats->max_ns)
+		stats->max_ns = delay;
+}
+
+/*
+ * Start the next queued transaction if the bus is ours and idle. While a
+ * remote master is talking to us as a slave the controller is busy with
+ * that frame; ns9xxx_slave_stop() kicks the engine again once it ends.
+ */
+static void ns9xxx_engine_kick(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_xact *xact;
+
+	if (dev_data->phase != NS9XXX_PHASE_IDLE || dev_data->slave_frame)
+		return;
+
+	for (;;) {
+		xact = ns9xxx_engine_next(dev_data, NS9XXX_QOS_CLASSES);
+		if (!xact) {
+			del_timer(&dev_data->watchdog);
+			wake_up(&dev_data->idle_q);
+			return;
+		}
+		if (!ns9xxx_engine_expired(xact))
+			break;
+
+		/* too late to be of any use */
+		list_del(&xact->list);
+		dev_data->queued_ns[xact->prio] -= xact->wire_ns;
+		xact->result = -ETIME;
+		xact->complete(dev_data, xact);
+	}
+
+	if (readl(dev_data->ioaddr + I2C_STATUS) & I2C_STATUS_MCMDL) {
+		/* let the recovery code wait for (or force) the unlock */
+		ns9xxx_fr_snapshot(dev_data, "master module locked");
+		ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_SYNC);
+		schedule_work(&dev_data->recover_work);
+		return;
+	}
+
+	list_del(&xact->list);
+	dev_data->queued_ns[xact->prio] -= xact->wire_ns;
+	dev_data->busy_start = ktime_get();
+	ns9xxx_qos_account(dev_data, xact, dev_data->busy_start);
+
+	dev_data->cur = xact;
+	ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_XFER);
+	xact->msg = xact->first;
+	if (!xact->first) {
+		xact->bytes = 0;
+		ns9xxx_stat_inc(dev_data, xfers);
+	}
+	xact->ackpoll_until = 0;
+	ns9xxx_engine_start_msg(dev_data);
+}
+
+/* start the current transaction over after a STOP */
+static void ns9xxx_engine_restart(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_xact *xact = dev_data->cur;
+	int i;
+
+	if (ns9xxx_engine_expired(xact)) {
+		dev_data->cur = NULL;
+		ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_IDLE);
+		xact->result = -ETIME;
+		xact->complete(dev_data, xact);
+		ns9xxx_engine_kick(dev_data);
+		return;
+	}
+
+	/*
+	 * Arbitration was lost to a master that addressed us: queue the
+	 * transaction again at the front, to go once the slave frame ends.
+	 */
+	if (dev_data->slave_frame) {
+		dev_data->cur = NULL;
+		ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_IDLE);
+		list_add(&xact->list, &dev_data->queue[xact->prio]);
+		dev_data->queued_ns[xact->prio] += xact->wire_ns;
+		return;
+	}
+
+	ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_XFER);
+	xact->msg = xact->first;
+	xact->bytes = 0;
+	for (i = 0; i < xact->first; i++)
+		xact->bytes += xact->msgs[i].len;
+	ns9xxx_engine_start_msg(dev_data);
+}
+
+/*
+ * Between two messages of a bulk transaction, put a STOP on the bus and
+ * queue the rest of it again if more urgent work is waiting. Only a write
+ * with its own START starts an independent piece: a read usually depends
+ * on the register pointer the write before it has set, which a transaction
+ * let in between could move.
+ */
+static int ns9xxx_engine_preempt(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_xact *xact = dev_data->cur;
+
+	if (xact->prio != NS9XXX_QOS_BULK ||
+			(xact->msgs[xact->msg].flags &
+				(I2C_M_NOSTART | I2C_M_RD)) ||
+			!ns9xxx_engine_next(dev_data, NS9XXX_QOS_BULK))
+		return 0;
+
+	xact->first = xact->msg;
+	xact->queued = ktime_get();
+	xact->wire_ns = ns9xxx_wire_ns(dev_data, xact->msgs + xact->first,
+			xact->num - xact->first);
+	dev_data->queued_ns[NS9XXX_QOS_BULK] += xact->wire_ns;
+	list_add(&xact->list, &dev_data->queue[NS9XXX_QOS_BULK]);
+	dev_data->qos_stats[NS9XXX_QOS_BULK].splits++;
+
+	dev_data->cur = NULL;
+	ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_STOP);
+	ns9xxx_engine_cmd(dev_data, I2C_CMD_STOP);
+
+	return 1;
+}
+
+/*
+ * NACK in the current transaction: 1 to poll again, -ETIMEDOUT if polling
+ * is over, 0 if the transaction does not poll or is past its address.
+ */
+static int ns9xxx_engine_ackpoll(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_xact *xact = dev_data->cur;
+	u64 now;
+
+	if (!(xact->flags & NS9XXX_XACT_ACKPOLL) || xact->msg || xact->pos)
+		return 0;
+
+	now = ktime_to_ns(ktime_get());
+	if (!xact->ackpoll_until)
+		xact->ackpoll_until = now + xact->ackpoll_ns;
+
+	return now < xact->ackpoll_until ? 1 : -ETIMEDOUT;
+}
+
+/*
+ * End the data phase of the current transaction and put a STOP on the bus.
+ * A transaction that wants timestamps is only completed on the STOP ACK.
+ */
+static void ns9xxx_engine_stop(struct ns9xxx_i2c *dev_data, int result)
+{
+	struct ns9xxx_xact *xact = dev_data->cur;
+
+	dev_data->cur = NULL;
+	ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_STOP);
+	ns9xxx_engine_cmd(dev_data, I2C_CMD_STOP);
+
+	xact->result = result;
+	if (xact->flags & NS9XXX_XACT_TSTAMP)
+		dev_data->stopping = xact;
+	else
+		xact->complete(dev_data, xact);
+}
+
+/* complete the transaction waiting for its STOP, ts 0 if it was not ACKed */
+static void ns9xxx_engine_stopped(struct ns9xxx_i2c *dev_data, ktime_t ts)
+{
+	struct ns9xxx_xact *xact = dev_data->stopping;
+
+	if (!xact)
+		return;
+
+	dev_data->stopping = NULL;
+	xact->ts_stop = ts;
+	xact->complete(dev_data, xact);
+}
+
+static void ns9xxx_engine_irq(struct ns9xxx_i2c *dev_data, u32 status)
+{
+	struct ns9xxx_xact *xact = dev_data->cur;
+	struct i2c_msg *msg;
+	ktime_t now;
+	u64 interval;
+	int ret;
+
+	ns9xxx_hist_end(dev_data, NS9XXX_HIST_CMD, dev_data->cmd_start);
+	dev_data->cmd_start = ktime_set(0, 0);
+
+	switch (dev_data->phase) {
+	case NS9XXX_PHASE_XFER:
+		break;
+	case NS9XXX_PHASE_STOP:
+		if ((status & I2C_STATUS_IRQCD_MASK) != I2C_IRQ_CMDACK) {
+			ns9xxx_warn(dev_data, "STOP not acknowledged (STATUS 0x%lx)\n", (unsigned long)status);
+			ns9xxx_engine_stopped(dev_data, ktime_set(0, 0));
+			ns9xxx_fr_snapshot(dev_data, "STOP not acknowledged");
+			ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_SYNC);
+			schedule_work(&dev_data->recover_work);
+			return;
+		}
+		now = ktime_get();
+		ns9xxx_stat_add(dev_data, busy_ns,
+				ktime_to_ns(ktime_sub(now, dev_data->busy_start)));
+		if (dev_data->stopping)
+			ns9xxx_engine_stopped(dev_data, now);
+		ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_IDLE);
+		ns9xxx_engine_kick(dev_data);
+		return;
+	case NS9XXX_PHASE_ACKPOLL:
+		interval = ns9xxx_param_ns(&ackpoll_interval,
+				NS9XXX_ACKPOLL_INTERVAL_MAX_US, NSEC_PER_USEC);
+		if (interval) {
+			ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_ACKWAIT);
+			del_timer(&dev_data->watchdog);
+			hrtimer_start(&dev_data->ackpoll_timer,
+					ns_to_ktime(interval), HRTIMER_MODE_REL);
+			return;
+		}
+		/* fall through */
+	case NS9XXX_PHASE_RESTART:
+		ns9xxx_engine_restart(dev_data);
+		return;
+	default:
+		/* spurious, nothing outstanding */
+		return;
+	}
+
+	msg = &xact->msgs[xact->msg];
+
+	switch (status & I2C_STATUS_IRQCD_MASK) {
+	case I2C_IRQ_RXDATA:
+		if (msg->flags & I2C_M_RD)
+			msg->buf[xact->pos] = status & I2C_STATUS_RXDATA_MASK;
+	case I2C_IRQ_CMDACK:
+	case I2C_IRQ_TXDATA:
+		break;
+	case I2C_IRQ_NOACK:
+		ns9xxx_stat_inc(dev_data, nacks);
+		if (msg->flags & I2C_M_IGNORE_NAK)
+			break;
+		ret = ns9xxx_engine_ackpoll(dev_data);
+		if (ret > 0) {
+			ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_ACKPOLL);
+			ns9xxx_engine_cmd(dev_data, I2C_CMD_STOP);
+		} else
+			ns9xxx_engine_stop(dev_data, ret ? ret : -EIO);
+		return;
+	case I2C_IRQ_ARBITLOST:
+		ns9xxx_stat_inc(dev_data, arbitration_lost);
+		if (--xact->retries > 0) {
+			ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_RESTART);
+			ns9xxx_engine_cmd(dev_data, I2C_CMD_STOP);
+		} else
+			ns9xxx_engine_stop(dev_data, -EAGAIN);
+		return;
+	default:
+		ns9xxx_engine_stop(dev_data, -EIO);
+		return;
+	}
+
+	/* the first interrupt of a transaction is its address (and byte) ACK */
+	if ((xact->flags & NS9XXX_XACT_TSTAMP) && !xact->msg && !xact->pos)
+		xact->ts_addr = ktime_get();
+
+	xact->bytes++;
+	if (msg->flags & I2C_M_RD)
+		ns9xxx_stat_inc(dev_data, read_bytes);
+	else
+		ns9xxx_stat_inc(dev_data, write_bytes);
+
+	/* out of time: give up at this byte boundary, with a clean STOP */
+	if (xact->deadline && (xact->pos + 1 < msg->len ||
+				xact->msg + 1 < xact->num) &&
+			ns9xxx_engine_expired(xact)) {
+		ns9xxx_engine_stop(dev_data, -ETIME);
+		return;
+	}
+
+	if (++xact->pos < msg->len)
+		ns9xxx_engine_next_byte(dev_data);
+	else if (++xact->msg < xact->num) {
+		if (!ns9xxx_engine_preempt(dev_data))
+			ns9xxx_engine_start_msg(dev_data);
+	} else
+		ns9xxx_engine_stop(dev_data, xact->num);
+}
+
+static void ns9xxx_engine_watchdog(unsigned long data)
+{
+	struct ns9xxx_i2c *dev_data = (struct ns9xxx_i2c *)data;
+	struct ns9xxx_xact *xact;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+
+	switch (dev_data->phase) {
+	case NS9XXX_PHASE_XFER:
+	case NS9XXX_PHASE_STOP:
+	case NS9XXX_PHASE_RESTART:
+	case NS9XXX_PHASE_ACKPOLL:
+		ns9xxx_warn(dev_data, "timeout waiting for interrupt (phase %d, timeout = %d)\n", dev_data->phase, (int)(dev_data->adap.timeout));
+		trace_i2c_ns9xxx_timeout(dev_data->adap.nr, dev_data->phase, 0);
+		ns9xxx_stat_inc(dev_data, timeouts);
+		ns9xxx_fr_snapshot(dev_data, "interrupt timeout");
+		xact = dev_data->cur;
+		dev_data->cur = NULL;
+		ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_SYNC);
+		if (xact) {
+			xact->result = -ETIMEDOUT;
+			xact->complete(dev_data, xact);
+		}
+		ns9xxx_engine_stopped(dev_data, ktime_set(0, 0));
+		schedule_work(&dev_data->recover_work);
+		break;
+	default:
+		break;
+	}
+
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+}
+
+static enum hrtimer_restart ns9xxx_engine_ackpoll_timer(struct hrtimer *timer)
+{
+	struct ns9xxx_i2c *dev_data =
+		container_of(timer, struct ns9xxx_i2c, ackpoll_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	if (dev_data->phase == NS9XXX_PHASE_ACKWAIT)
+		ns9xxx_engine_restart(dev_data);
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Register read: a one byte write and a read from the same device, with a
+ * repeated START in between. Both commands are worked out here, so the
+ * interrupt handler only has to issue them.
+ */
+static void ns9xxx_engine_prepare(struct ns9xxx_xact *xact)
+{
+	const struct i2c_msg *msgs = xact->msgs;
+
+	xact->flags &= ~NS9XXX_XACT_REGREAD;
+
+	if (xact->num != 2 || msgs[0].len != 1 ||
+			(msgs[0].flags & (I2C_M_RD | I2C_M_NOSTART)) ||
+			!(msgs[1].flags & I2C_M_RD) ||
+			(msgs[1].flags & I2C_M_NOSTART) ||
+			msgs[0].addr != msgs[1].addr ||
+			((msgs[0].flags ^ msgs[1].flags) & I2C_M_TEN))
+		return;
+
+	xact->flags |= NS9XXX_XACT_REGREAD;
+	xact->masteraddr = ns9xxx_engine_masteraddr(&msgs[0]);
+	xact->cmd[0] = I2C_CMD_WRITE | I2C_CMD_TXVAL | msgs[0].buf[0];
+	xact->cmd[1] = I2C_CMD_READ;
+}
+
+static void ns9xxx_engine_queue(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_xact *xact)
+{
+	const struct i2c_msg *msg = &xact->msgs[0];
+	u64 ahead;
+	int i;
+
+	xact->retries = NS9XXX_ARBITLOST_RETRIES;
+	xact->first = 0;
+	ns9xxx_engine_prepare(xact);
+	ns9xxx_cache_invalidate(dev_data, xact);
+
+	if (xact->qos != NS9XXX_QOS_AUTO)
+		xact->prio = xact->qos;
+	else if (msg->flags & I2C_M_TEN)
+		xact->prio = NS9XXX_QOS_NORMAL;
+	else
+		xact->prio = dev_data->qos_addr[msg->addr & 0x7f];
+
+	xact->queued = ktime_get();
+	xact->wire_ns = ns9xxx_wire_ns(dev_data, xact->msgs, xact->num);
+
+	/* fail right away what cannot be done in time */
+	if (xact->deadline) {
+		ahead = dev_data->cur ? dev_data->cur->wire_ns : 0;
+		for (i = 0; i <= xact->prio; i++)
+			ahead += dev_data->queued_ns[i];
+
+		if (ktime_to_ns(xact->queued) + ahead + xact->wire_ns >
+				xact->deadline) {
+			xact->bytes = 0;
+			xact->result = -ETIME;
+			xact->complete(dev_data, xact);
+			return;
+		}
+	}
+
+	dev_data->queued_ns[xact->prio] += xact->wire_ns;
+	list_add_tail(&xact->list, &dev_data->queue[xact->prio]);
+	ns9xxx_engine_kick(dev_data);
+}
+
+static void ns9xxx_engine_submit(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_xact *xact)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	ns9xxx_engine_queue(dev_data, xact);
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+}
+
+static int ns9xxx_engine_try_claim(struct ns9xxx_i2c *dev_data)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	if (dev_data->phase == NS9XXX_PHASE_IDLE && !dev_data->slave_frame) {
+		ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_SYNC);
+		ret = 1;
+	}
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	return ret;
+}
+
+/* take the controller away from the engine for ns9xxx_i2c_send_cmd() */
+static void ns9xxx_engine_claim(struct ns9xxx_i2c *dev_data)
+{
+	wait_event(dev_data->idle_q, ns9xxx_engine_try_claim(dev_data));
+}
+
+static void ns9xxx_engine_release(struct ns9xxx_i2c *dev_data)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	ns9xxx_engine_set_phase(dev_data, NS9XXX_PHASE_IDLE);
+	/* the controller may have been reset */
+	dev_data->masteraddr = ~0;
+	ns9xxx_engine_kick(dev_data);
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+}
+
+static void ns9xxx_engine_recover(struct work_struct *work)
+{
+	struct ns9xxx_i2c *dev_data =
+		container_of(work, struct ns9xxx_i2c, recover_work);
+	ktime_t start = ns9xxx_hist_start();
+
+	ns9xxx_fr_report(dev_data);
+	ns9xxx_i2c_unstick(dev_data);
+	ns9xxx_engine_release(dev_data);
+
+	ns9xxx_hist_end(dev_data, NS9XXX_HIST_RECOVERY, start);
+}
+
+static void ns9xxx_xact_wake(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_xact *xact)
+{
+	xact->completed = ns9xxx_hist_start();
+	complete(&xact->done);
+}
+
+/*
+ * Messages the engine can run: no bitbang. The controller sends the
+ * address byte and the read ACKs itself, so I2C_M_REV_DIR_ADDR and
+ * I2C_M_NO_RD_ACK cannot be done, and neither can a change of direction
+ * without a START. As before the engine, other flags are ignored and
+ * I2C_M_NOSTART on the first message gets a START anyway.
+ */
+static int ns9xxx_xact_check(const struct i2c_msg *msgs, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (msgs[i].flags & (I2C_M_REV_DIR_ADDR | I2C_M_NO_RD_ACK))
+			return -EOPNOTSUPP;
+		if (!msgs[i].len)
+			return -EINVAL;
+		if (!i || !(msgs[i].flags & I2C_M_NOSTART))
+			continue;
+		if ((msgs[i].flags ^ msgs[i - 1].flags) & I2C_M_RD)
+			return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+static void ns9xxx_xact_init(struct ns9xxx_xact *xact,
+		struct i2c_msg *msgs, int num)
+{
+	xact->msgs = msgs;
+	xact->num = num;
+	xact->flags = 0;
+	xact->qos = NS9XXX_QOS_AUTO;
+	xact->deadline = 0;
+	xact->ts_addr = ktime_set(0, 0);
+	xact->ts_stop = ktime_set(0, 0);
+	xact->complete = ns9xxx_xact_wake;
+	init_completion(&xact->done);
+}
+
+/* apply NS9XXX_I2C_XFER_* flags from userspace */
+static int ns9xxx_xact_set_flags(struct ns9xxx_xact *xact, u32 flags)
+{
+	if (flags & ~(NS9XXX_I2C_XFER_ACKPOLL | NS9XXX_I2C_XFER_URGENT |
+				NS9XXX_I2C_XFER_BULK | NS9XXX_I2C_XFER_TIMESTAMP))
+		return -EINVAL;
+
+	switch (flags & (NS9XXX_I2C_XFER_URGENT | NS9XXX_I2C_XFER_BULK)) {
+	case NS9XXX_I2C_XFER_URGENT:
+		xact->qos = NS9XXX_QOS_URGENT;
+		break;
+	case NS9XXX_I2C_XFER_BULK:
+		xact->qos = NS9XXX_QOS_BULK;
+		break;
+	case 0:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (flags & NS9XXX_I2C_XFER_ACKPOLL) {
+		xact->flags |= NS9XXX_XACT_ACKPOLL;
+		xact->ackpoll_ns = ns9xxx_param_ns(&ackpoll_timeout,
+				NS9XXX_ACKPOLL_TIMEOUT_MAX_MS, NSEC_PER_MSEC);
+	}
+
+	if (flags & NS9XXX_I2C_XFER_TIMESTAMP)
+		xact->flags |= NS9XXX_XACT_TSTAMP;
+
+	return 0;
+}
+
+/* deadline in us from now, 0 for none */
+static void ns9xxx_xact_set_deadline(struct ns9xxx_xact *xact, u32 us)
+{
+	xact->deadline = 0;
+	if (us)
+		xact->deadline = ktime_to_ns(ktime_get()) +
+			(u64)us * NSEC_PER_USEC;
+}
+
+/* queue a transaction and sleep until its data phase is done */
+static int ns9xxx_engine_run(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_xact *xact)
+{
+	ns9xxx_engine_submit(dev_data, xact);
+	wait_for_completion(&xact->done);
+	ns9xxx_hist_end(dev_data, NS9XXX_HIST_WAKEUP, xact->completed);
+
+	return xact->result;
+}
+
+
+/*
+ * Slave mode
+ *
+ * The controller answers to I2C_SLAVEADDR and interrupts for every byte;
+ * ns9xxx_slave_irq() turns that into events for the attached backend. It
+ * does not signal the STOP, so a frame ends at the next address match, at
+ * the NACK of a read, on a receive abort or once the bus has been quiet
+ * for slave_stop_us.
+ *
+ * Master and slave share the command register, so the engine starts no
+ * transaction during a frame: ns9xxx_engine_kick() and the claim of
+ * ns9xxx_i2c_send_cmd() wait for it to end, and a transaction that lost
+ * arbitration to the master addressing us is queued again instead of
+ * being retried over the frame.
+ */
+
+static void ns9xxx_slave_event(struct ns9xxx_i2c *dev_data,
+		enum ns9xxx_slave_event event, u8 *val)
+{
+	dev_data->slave->event(dev_data, event, val);
+}
+
+static void ns9xxx_slave_stop(struct ns9xxx_i2c *dev_data)
+{
+	if (!dev_data->slave_frame)
+		return;
+
+	dev_data->slave_frame = 0;
+	ns9xxx_slave_event(dev_data, NS9XXX_SLAVE_STOP, NULL);
+	ns9xxx_engine_kick(dev_data);
+}
+
+static void ns9xxx_slave_start(struct ns9xxx_i2c *dev_data,
+		enum ns9xxx_slave_event event, u8 *val)
+{
+	/* back to back frames: no master transaction in between */
+	if (dev_data->slave_frame)
+		ns9xxx_slave_event(dev_data, NS9XXX_SLAVE_STOP, NULL);
+	dev_data->slave_frame = 1;
+	ns9xxx_slave_event(dev_data, event, val);
+}
+
+static void ns9xxx_slave_send(struct ns9xxx_i2c *dev_data, u8 val)
+{
+	writel(I2C_CMD_NOP | I2C_CMD_TXVAL | val, dev_data->ioaddr + I2C_CMD);
+}
+
+static void ns9xxx_slave_irq(struct ns9xxx_i2c *dev_data, u32 status)
+{
+	u8 val = status & I2C_STATUS_RXDATA_MASK;
+
+	if (!dev_data->slave)
+		return;
+
+	switch (status & I2C_STATUS_IRQCD_MASK) {
+	case I2C_IRQ_S_RXDATA_1ST:
+		ns9xxx_slave_start(dev_data, NS9XXX_SLAVE_WRITE_REQUESTED,
+				&val);
+		val = status & I2C_STATUS_RXDATA_MASK;
+		/* fall through */
+	case I2C_IRQ_S_RXDATA:
+		ns9xxx_slave_event(dev_data, NS9XXX_SLAVE_WRITE_RECEIVED, &val);
+		break;
+	case I2C_IRQ_S_CMDREQ:
+		ns9xxx_slave_start(dev_data, NS9XXX_SLAVE_READ_REQUESTED, &val);
+		ns9xxx_slave_send(dev_data, val);
+		break;
+	case I2C_IRQ_S_TXDATA_1ST:
+	case I2C_IRQ_S_TXDATA:
+		ns9xxx_slave_event(dev_data, NS9XXX_SLAVE_READ_PROCESSED, &val);
+		ns9xxx_slave_send(dev_data, val);
+		break;
+	case I2C_IRQ_S_NOACK:
+	case I2C_IRQ_S_RXABORT:
+		ns9xxx_slave_stop(dev_data);
+		return;
+	default:
+		/* general call, not supported */
+		return;
+	}
+
+	hrtimer_start(&dev_data->slave_timer,
+			ns_to_ktime(ns9xxx_param_ns(&slave_stop_us,
+					NS9XXX_SLAVE_STOP_MAX_US,
+					NSEC_PER_USEC)),
+			HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart ns9xxx_slave_timer(struct hrtimer *timer)
+{
+	struct ns9xxx_i2c *dev_data =
+		container_of(timer, struct ns9xxx_i2c, slave_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	if (dev_data->slave)
+		ns9xxx_slave_stop(dev_data);
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void ns9xxx_slave_detach(struct ns9xxx_i2c *dev_data)
+{
+	const struct ns9xxx_slave_ops *ops = dev_data->slave;
+	unsigned long flags;
+
+	if (!ops)
+		return;
+
+	writel(I2C_SLAVEADDR_GCDI, dev_data->ioaddr + I2C_SLAVEADDR);
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	ns9xxx_slave_stop(dev_data);
+	dev_data->slave = NULL;
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	hrtimer_cancel(&dev_data->slave_timer);
+
+	ops->detach(dev_data);
+	dev_data->slave_priv = NULL;
+}
+
+/* called with slave_lock held */
+static int ns9xxx_slave_attach(struct ns9xxx_i2c *dev_data,
+		const struct ns9xxx_slave_ops *ops, u16 addr)
+{
+	unsigned long flags;
+	int ret;
+
+	ns9xxx_slave_detach(dev_data);
+
+	ret = ops->attach(dev_data);
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	dev_data->slave = ops;
+	dev_data->slave_addr = addr;
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	writel(((addr & I2C_MASTERADDR_ADDRMASK) << I2C_MASTERADDR_ADDRSHIFT) |
+			I2C_MASTERADDR_7BIT | I2C_SLAVEADDR_GCDI,
+			dev_data->ioaddr + I2C_SLAVEADDR);
+
+	return 0;
+}
+
+/*
+ * EEPROM backend, as the Linux slave-eeprom driver: 256 bytes, the first
+ * byte of a write sets the address, reads and writes auto-increment. The
+ * contents are in the slave-eeprom sysfs file.
+ */
+#define NS9XXX_SLAVE_EEPROM_SIZE	256
+
+struct ns9xxx_slave_eeprom {
+	struct bin_attribute	attr;
+	u8			idx;
+	int			idx_pending;	/* next byte written is idx */
+	u8			buf[NS9XXX_SLAVE_EEPROM_SIZE];
+};
+
+static void ns9xxx_slave_eeprom_event(struct ns9xxx_i2c *dev_data,
+		enum ns9xxx_slave_event event, u8 *val)
+{
+	struct ns9xxx_slave_eeprom *eeprom = dev_data->slave_priv;
+
+	switch (event) {
+	case NS9XXX_SLAVE_WRITE_RECEIVED:
+		if (eeprom->idx_pending) {
+			eeprom->idx = *val;
+			eeprom->idx_pending = 0;
+		} else
+			eeprom->buf[eeprom->idx++] = *val;
+		break;
+	case NS9XXX_SLAVE_READ_PROCESSED:
+		eeprom->idx++;
+		/* fall through */
+	case NS9XXX_SLAVE_READ_REQUESTED:
+		*val = eeprom->buf[eeprom->idx];
+		break;
+	case NS9XXX_SLAVE_WRITE_REQUESTED:
+	case NS9XXX_SLAVE_STOP:
+		eeprom->idx_pending = 1;
+		break;
+	}
+}
+
+static ssize_t ns9xxx_slave_eeprom_read(struct file *filp,
+		struct kobject *kobj, struct bin_attribute *attr, char *buf,
+		loff_t off, size_t count)
+{
+	struct ns9xxx_slave_eeprom *eeprom = attr->private;
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(kobj_to_dev(kobj));
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	memcpy(buf, eeprom->buf + off, count);
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	return count;
+}
+
+static ssize_t ns9xxx_slave_eeprom_write(struct file *filp,
+		struct kobject *kobj, struct bin_attribute *attr, char *buf,
+		loff_t off, size_t count)
+{
+	struct ns9xxx_slave_eeprom *eeprom = attr->private;
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(kobj_to_dev(kobj));
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	memcpy(eeprom->buf + off, buf, count);
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	return count;
+}
+
+static int ns9xxx_slave_eeprom_attach(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_slave_eeprom *eeprom;
+	int ret;
+
+	eeprom = kzalloc(sizeof(*eeprom), GFP_KERNEL);
+	if (!eeprom)
+		return -ENOMEM;
+
+	eeprom->idx_pending = 1;
+	eeprom->attr.attr.name = "slave-eeprom";
+	eeprom->attr.attr.mode = S_IRUSR | S_IWUSR;
+	eeprom->attr.size = NS9XXX_SLAVE_EEPROM_SIZE;
+	eeprom->attr.read = ns9xxx_slave_eeprom_read;
+	eeprom->attr.write = ns9xxx_slave_eeprom_write;
+	eeprom->attr.private = eeprom;
+
+	ret = sysfs_create_bin_file(&dev_data->dev->kobj, &eeprom->attr);
+	if (ret) {
+		kfree(eeprom);
+		return ret;
+	}
+
+	dev_data->slave_priv = eeprom;
+
+	return 0;
+}
+
+static void ns9xxx_slave_eeprom_detach(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_slave_eeprom *eeprom = dev_data->slave_priv;
+
+	sysfs_remove_bin_file(&dev_data->dev->kobj, &eeprom->attr);
+	kfree(eeprom);
+}
+
+static const struct ns9xxx_slave_ops ns9xxx_slave_eeprom_ops = {
+	.name		= "eeprom",
+	.attach		= ns9xxx_slave_eeprom_attach,
+	.detach		= ns9xxx_slave_eeprom_detach,
+	.event		= ns9xxx_slave_eeprom_event,
+};
+
+/*
+ * Read cache
+ *
+ * Register reads (a one byte write, then a read from the same device) that
+ * match a rule set through the read_cache sysfs attribute are answered from
+ * the last result until its TTL runs out. Any other write to the device
+ * drops its entries; as this is done when the write is queued, a read that
+ * was on the bus at that time is not cached. ns9xxx_i2c_xfer() runs with
+ * the adapter locked, so there is never more than one read to fill an
+ * entry, but the rule itself can be changed through sysfs meanwhile.
+ */
+
+static struct ns9xxx_cache_entry *ns9xxx_cache_lookup(
+		struct ns9xxx_i2c *dev_data, const struct i2c_msg *msgs, int num)
+{
+	struct ns9xxx_cache_entry *e;
+
+	if (!dev_data->cache_rules || num != 2 || msgs[0].flags ||
+			msgs[0].len != 1 || msgs[1].flags != I2C_M_RD ||
+			msgs[0].addr != msgs[1].addr)
+		return NULL;
+
+	for (e = dev_data->cache; e < dev_data->cache + NS9XXX_CACHE_ENTRIES;
+			e++)
+		if (e->ttl_ns && e->addr == msgs[0].addr &&
+				e->reg == msgs[0].buf[0] &&
+				e->len == msgs[1].len)
+			return e;
+
+	return NULL;
+}
+
+/* called from ns9xxx_engine_queue() */
+static void ns9xxx_cache_invalidate(struct ns9xxx_i2c *dev_data,
+		const struct ns9xxx_xact *xact)
+{
+	const struct i2c_msg *msgs = xact->msgs;
+	struct ns9xxx_cache_entry *e;
+	int i;
+
+	if (!dev_data->cache_rules)
+		return;
+
+	for (i = 0; i < xact->num; i++) {
+		if (msgs[i].flags & I2C_M_RD)
+			continue;
+		/* register address for the read that follows */
+		if (msgs[i].len == 1 && i + 1 < xact->num &&
+				(msgs[i + 1].flags & I2C_M_RD) &&
+				msgs[i + 1].addr == msgs[i].addr)
+			continue;
+
+		for (e = dev_data->cache;
+				e < dev_data->cache + NS9XXX_CACHE_ENTRIES; e++)
+			if (e->ttl_ns && e->addr == msgs[i].addr) {
+				e->valid = 0;
+				e->gen++;
+			}
+	}
+}
+
+/* result of a cached read, or 0 if the caller has to do it */
+static int ns9xxx_cache_xfer(struct ns9xxx_i2c *dev_data,
+		struct i2c_msg *msgs, int num)
+{
+	struct ns9xxx_cache_entry *e;
+	struct ns9xxx_xact xact;
+	unsigned long flags;
+	u32 id, gen;
+	int ret;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+
+	e = ns9xxx_cache_lookup(dev_data, msgs, num);
+	if (!e) {
+		spin_unlock_irqrestore(&dev_data->lock, flags);
+		return 0;
+	}
+	id = e->id;
+
+	if (e->valid && ktime_to_ns(ktime_get()) < e->expires) {
+		memcpy(msgs[1].buf, e->data, e->len);
+		e->hits++;
+		spin_unlock_irqrestore(&dev_data->lock, flags);
+		return num;
+	}
+
+	e->misses++;
+	gen = e->gen;
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	ns9xxx_xact_init(&xact, msgs, num);
+	ret = ns9xxx_engine_run(dev_data, &xact);
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	if (e->id == id && e->gen == gen && ret == num) {
+		memcpy(e->data, msgs[1].buf, e->len);
+		e->valid = 1;
+		e->expires = ktime_to_ns(ktime_get()) + e->ttl_ns;
+	}
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	return ret;
+}
+
+
+/*
+ * Write-behind
+ *
+ * Single message register writes to devices enabled in the write_behind
+ * sysfs attribute return at once and are sent together, write_behind_ms
+ * later. A write to the same register as the last pending write to that
+ * device replaces it. For devices set to coalesce, a write to the register
+ * after the last one of the pending write (auto-increment) is appended to
+ * it, and one that overlaps it is merged into it. Any other transfer with
+ * a message to such a device flushes the pending writes first, so it sees
+ * them done: ns9xxx_wb_order() is called on every path that queues on the
+ * engine from process context. Only the sampler, which queues from its
+ * timer, can read a register up to write_behind_ms before a pending write
+ * to it lands. Failures are only counted, logged and notified on the
+ * write_behind_stats attribute.
+ */
+
+static void ns9xxx_wb_flush(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_wb_req *req;
+	unsigned long flags;
+	int i, n, failed = 0;
+
+	mutex_lock(&dev_data->wb_flush_lock);
+
+	mutex_lock(&dev_data->wb_lock);
+	n = dev_data->wb_npending;
+	for (i = 0; i < n; i++) {
+		req = &dev_data->wb_reqs[i];
+		req->write = dev_data->wb_pending[i];
+		req->msg.addr = req->write.addr;
+		req->msg.flags = 0;
+		req->msg.len = req->write.len;
+		req->msg.buf = req->write.buf;
+		ns9xxx_xact_init(&req->xact, &req->msg, 1);
+	}
+	dev_data->wb_npending = 0;
+	mutex_unlock(&dev_data->wb_lock);
+
+	if (!n) {
+		mutex_unlock(&dev_data->wb_flush_lock);
+		return;
+	}
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	for (i = 0; i < n; i++)
+		ns9xxx_engine_queue(dev_data, &dev_data->wb_reqs[i].xact);
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	for (i = 0; i < n; i++) {
+		req = &dev_data->wb_reqs[i];
+		wait_for_completion(&req->xact.done);
+		if (req->xact.result < 0) {
+			ns9xxx_warn(dev_data, "write-behind to 0x%02x, register 0x%02x failed (%d)\n", req->write.addr, req->write.buf[0], req->xact.result);
+			failed++;
+		}
+	}
+
+	mutex_lock(&dev_data->wb_lock);
+	dev_data->wb_stats.flushes++;
+	dev_data->wb_stats.failed += failed;
+	mutex_unlock(&dev_data->wb_lock);
+
+	mutex_unlock(&dev_data->wb_flush_lock);
+
+	if (failed)
+		sysfs_notify(&dev_data->dev->kobj, NULL, "write_behind_stats");
+}
+
+static void ns9xxx_wb_work(struct work_struct *work)
+{
+	struct ns9xxx_i2c *dev_data =
+		container_of(work, struct ns9xxx_i2c, wb_work.work);
+
+	ns9xxx_wb_flush(dev_data);
+}
+
+/* fold msg into the pending write w if the device allows it */
+static int ns9xxx_wb_merge(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_wb_write *w, const struct i2c_msg *msg)
+{
+	int off = msg->buf[0] - w->buf[0];
+
+	if (w->len == msg->len && !off) {
+		memcpy(w->buf, msg->buf, msg->len);
+		dev_data->wb_stats.merged++;
+		return 1;
+	}
+
+	if (!(dev_data->wb_addr[msg->addr] & NS9XXX_WB_COALESCE) ||
+			off < 0 || off > w->len - 1 ||
+			1 + off + msg->len - 1 > NS9XXX_WB_MAX_LEN)
+		return 0;
+
+	memcpy(w->buf + 1 + off, msg->buf + 1, msg->len - 1);
+
+	if (off == w->len - 1) {
+		dev_data->wb_stats.coalesced++;
+		dev_data->wb_stats.saved_ns += div_u64(
+				(u64)NS9XXX_WB_SAVED_CLOCKS * NSEC_PER_SEC,
+				dev_data->bus_freq);
+	} else
+		dev_data->wb_stats.merged++;
+
+	w->len = max_t(u16, w->len, off + msg->len);
+
+	return 1;
+}
+
+static int ns9xxx_wb_queue(struct ns9xxx_i2c *dev_data,
+		const struct i2c_msg *msg)
+{
+	struct ns9xxx_wb_write *w, *last = NULL;
+
+	mutex_lock(&dev_data->wb_lock);
+
+	while (dev_data->wb_npending == NS9XXX_WB_ENTRIES) {
+		mutex_unlock(&dev_data->wb_lock);
+		ns9xxx_wb_flush(dev_data);
+		mutex_lock(&dev_data->wb_lock);
+	}
+
+	for (w = dev_data->wb_pending;
+			w < dev_data->wb_pending + dev_data->wb_npending; w++)
+		if (w->addr == msg->addr)
+			last = w;
+
+	dev_data->wb_stats.queued++;
+
+	if (!last || !ns9xxx_wb_merge(dev_data, last, msg)) {
+		w = &dev_data->wb_pending[dev_data->wb_npending++];
+		w->addr = msg->addr;
+		w->len = msg->len;
+		memcpy(w->buf, msg->buf, msg->len);
+
+		if (dev_data->wb_npending == 1)
+			schedule_delayed_work(&dev_data->wb_work,
+					msecs_to_jiffies(write_behind_ms));
+	}
+
+	mutex_unlock(&dev_data->wb_lock);
+
+	return 1;
+}
+
+static u8 ns9xxx_wb_mode(struct ns9xxx_i2c *dev_data,
+		const struct i2c_msg *msg)
+{
+	if ((msg->flags & I2C_M_TEN) || msg->addr > 0x7f)
+		return 0;
+
+	return dev_data->wb_addr[msg->addr];
+}
+
+/* flush before a transfer with any message to a write-behind device */
+static void ns9xxx_wb_order(struct ns9xxx_i2c *dev_data,
+		const struct i2c_msg *msgs, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (ns9xxx_wb_mode(dev_data, &msgs[i])) {
+			ns9xxx_wb_flush(dev_data);
+			return;
+		}
+	}
+}
+
+/* 1 if the transfer was queued behind, 0 if the caller has to do it */
+static int ns9xxx_wb_xfer(struct ns9xxx_i2c *dev_data,
+		struct i2c_msg *msgs, int num)
+{
+	u8 mode = ns9xxx_wb_mode(dev_data, &msgs[0]);
+
+	if (mode && num == 1 && !msgs[0].flags && msgs[0].len >= 2 &&
+			msgs[0].len <= ((mode & NS9XXX_WB_COALESCE) ?
+				NS9XXX_WB_MAX_LEN : NS9XXX_WB_ON_MAX_LEN))
+		return ns9xxx_wb_queue(dev_data, &msgs[0]);
+
+	ns9xxx_wb_order(dev_data, msgs, num);
+
+	return 0;
+}
+
+
+/*
+ * The controller cannot send a zero-length message, so as before the
+ * engine such messages are sent by bitbang, each with its own START and
+ * STOP. The messages between them go to the engine in runs, so a transfer
+ * that has one is not a single bus transaction.
+ */
+static int ns9xxx_i2c_bitbang_xfer(struct ns9xxx_i2c *dev_data,
+		struct i2c_msg msgs[], int num)
+{
+	struct ns9xxx_xact xact;
+	int i = 0, n, ret;
+
+	ns9xxx_wb_order(dev_data, msgs, num);
+
+	while (i < num) {
+		if (!msgs[i].len) {
+			/* send using use bitbang mode */
+			ns9xxx_engine_claim(dev_data);
+			ret = ns9xxx_i2c_bitbang(dev_data, &msgs[i]);
+			ns9xxx_i2c_unstick(dev_data);
+			ns9xxx_engine_release(dev_data);
+			if (ret < 0)
+				return ret;
+			i++;
+			continue;
+		}
+
+		for (n = 1; i + n < num && msgs[i + n].len; n++)
+			;
+		ret = ns9xxx_xact_check(msgs + i, n);
+		if (!ret) {
+			ns9xxx_xact_init(&xact, msgs + i, n);
+			ret = ns9xxx_engine_run(dev_data, &xact);
+		}
+		if (ret < 0)
+			return ret;
+		i += n;
+	}
+
+	return num;
+}
+
+static int ns9xxx_i2c_do_xfer(struct ns9xxx_i2c *dev_data,
+		struct i2c_msg msgs[], int num)
+{
+	struct ns9xxx_xact xact;
+	int i, ret;
+
+	for (i = 0; i < num; i++)
+		if (!msgs[i].len)
+			return ns9xxx_i2c_bitbang_xfer(dev_data, msgs, num);
+
+	ret = ns9xxx_xact_check(msgs, num);
+	if (ret)
+		return ret;
+
+	ret = ns9xxx_wb_xfer(dev_data, msgs, num);
+	if (ret)
+		return ret;
+
+	ret = ns9xxx_cache_xfer(dev_data, msgs, num);
+	if (ret)
+		return ret;
+
+	ns9xxx_xact_init(&xact, msgs, num);
+
+	return ns9xxx_engine_run(dev_data, &xact);
+}
+
+static int ns9xxx_i2c_xfer(struct i2c_adapter *adap,
+		struct i2c_msg msgs[], int num)
+{
+	struct ns9xxx_i2c *dev_data = (struct ns9xxx_i2c *)adap->algo_data;
+	ktime_t start = ns9xxx_hist_start();
+	ktime_t ts = ktime_set(0, 0);
+	int ret;
+
+	if (dev_data->cap)
+		ts = dev_data->cap->format == NS9XXX_CAP_PCAP ?
+			ktime_get_real() : ktime_get();
+
+	ret = ns9xxx_i2c_do_xfer(dev_data, msgs, num);
+	ns9xxx_hist_end(dev_data, NS9XXX_HIST_XFER, start);
+
+	if (dev_data->cap)
+		ns9xxx_cap_xfer(dev_data, ts, msgs, num, ret);
+
+	return ret;
+}
+
+/*
+ * Rings shared with userspace
+ *
+ * The kernel produces into a ring from interrupt context with
+ * dev_data->lock held; userspace consumes it through mmap() or read().
+ * The submission ring goes the other way. Only the index written by the
+ * other side is read from the shared header, and it is clamped to the
+ * ring.
+ */
+
+static int ns9xxx_ring_alloc(struct ns9xxx_ring *ring, u32 entries,
+		u32 entry_size)
+{
+	if (!entries || entries > NS9XXX_RING_MAX_ENTRIES ||
+			(entries & (entries - 1)))
+		return -EINVAL;
+
+	ring->size = PAGE_ALIGN(NS9XXX_RING_HDR_SIZE + entries * entry_size);
+	ring->hdr = vmalloc_user(ring->size);
+	if (!ring->hdr)
+		return -ENOMEM;
+
+	ring->entries = entries;
+	ring->mask = entries - 1;
+	ring->entry_size = entry_size;
+	ring->offset = NS9XXX_RING_HDR_SIZE;
+	ring->head = 0;
+	ring->tail = 0;
+
+	ring->hdr->entries = ring->entries;
+	ring->hdr->entry_size = ring->entry_size;
+	ring->hdr->offset = ring->offset;
+
+	return 0;
+}
+
+static void ns9xxx_ring_free(struct ns9xxx_ring *ring)
+{
+	vfree(ring->hdr);
+	ring->hdr = NULL;
+}
+
+static void *ns9xxx_ring_entry(struct ns9xxx_ring *ring, u32 index)
+{
+	return (char *)ring->hdr + ring->offset +
+		(index & ring->mask) * ring->entry_size;
+}
+
+/* tail of a ring the kernel produces into, a bogus one makes it full */
+static u32 ns9xxx_ring_user_tail(struct ns9xxx_ring *ring)
+{
+	u32 tail = ACCESS_ONCE(ring->hdr->tail);
+
+	if (ring->head - tail > ring->entries)
+		tail = ring->head - ring->entries;
+
+	return tail;
+}
+
+/* head of a ring the kernel consumes, a bogus one makes it empty */
+static u32 ns9xxx_ring_user_head(struct ns9xxx_ring *ring)
+{
+	u32 head = ACCESS_ONCE(ring->hdr->head);
+
+	if (head - ring->tail > ring->entries)
+		head = ring->tail;
+
+	return head;
+}
+
+/* entries of a ring the kernel produces into not consumed yet */
+static u32 ns9xxx_ring_used(struct ns9xxx_ring *ring)
+{
+	return ring->head - ns9xxx_ring_user_tail(ring);
+}
+
+static int ns9xxx_ring_empty(struct ns9xxx_ring *ring)
+{
+	return !ns9xxx_ring_used(ring);
+}
+
+/* next free entry, or NULL (and counted as dropped) if the ring is full */
+static void *ns9xxx_ring_produce_start(struct ns9xxx_ring *ring)
+{
+	if (ns9xxx_ring_used(ring) >= ring->entries) {
+		ring->hdr->dropped++;
+		return NULL;
+	}
+
+	return ns9xxx_ring_entry(ring, ring->head);
+}
+
+static void ns9xxx_ring_produce_end(struct ns9xxx_ring *ring)
+{
+	ring->head++;
+	/* publish the entry before the index */
+	smp_wmb();
+	ring->hdr->head = ring->head;
+}
+
+static int ns9xxx_ring_mmap(struct ns9xxx_ring *ring,
+		struct vm_area_struct *vma)
+{
+	if (!ring->hdr || vma->vm_end - vma->vm_start != ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->hdr, 0);
+}
+
+/* copy whole entries to a read() buffer */
+static ssize_t ns9xxx_ring_read(struct ns9xxx_ring *ring,
+		char __user *buf, size_t count)
+{
+	u32 size = ring->entry_size;
+	u32 tail = ns9xxx_ring_user_tail(ring);
+	ssize_t done = 0;
+
+	while (count - done >= size && tail != ACCESS_ONCE(ring->head)) {
+		smp_rmb();
+		if (copy_to_user(buf + done, ns9xxx_ring_entry(ring, tail),
+					size))
+			return -EFAULT;
+		done += size;
+		tail++;
+	}
+	ring->hdr->tail = tail;
+
+	return done;
+}
+
+
+/*
+ * Slave mailbox backend
+ *
+ * Frames written by the remote master are received straight into the
+ * entries of a ring that userspace mmap()s at NS9XXX_I2C_OFF_SLAVE; an
+ * entry is published, and readers woken, once per frame at its STOP. Reads
+ * by the remote master get 0xff.
+ *
+ * The backend is attached with NS9XXX_I2C_IOC_SLAVE_MBOX, not through
+ * sysfs: the ring belongs to the file that did it, which alone can map and
+ * poll it, and is freed when that file is closed.
+ */
+#define NS9XXX_MBOX_RING_ENTRIES	64
+
+static void ns9xxx_slave_mbox_event(struct ns9xxx_i2c *dev_data,
+		enum ns9xxx_slave_event event, u8 *val)
+{
+	struct ns9xxx_i2c_frame *frame = dev_data->mbox_cur;
+
+	switch (event) {
+	case NS9XXX_SLAVE_WRITE_REQUESTED:
+		frame = ns9xxx_ring_produce_start(&dev_data->mbox_ring);
+		if (frame) {
+			frame->timestamp_ns = ktime_to_ns(ktime_get());
+			frame->len = 0;
+			frame->flags = 0;
+		}
+		dev_data->mbox_cur = frame;
+		break;
+	case NS9XXX_SLAVE_WRITE_RECEIVED:
+		if (!frame)
+			break;
+		if (frame->len < NS9XXX_I2C_FRAME_MAX)
+			frame->data[frame->len++] = *val;
+		else
+			frame->flags |= NS9XXX_I2C_FRAME_TRUNCATED;
+		break;
+	case NS9XXX_SLAVE_READ_REQUESTED:
+	case NS9XXX_SLAVE_READ_PROCESSED:
+		*val = 0xff;
+		break;
+	case NS9XXX_SLAVE_STOP:
+		if (!frame)
+			break;
+		ns9xxx_ring_produce_end(&dev_data->mbox_ring);
+		dev_data->mbox_cur = NULL;
+		wake_up_interruptible(&dev_data->mbox_wait);
+		break;
+	}
+}
+
+static int ns9xxx_slave_mbox_attach(struct ns9xxx_i2c *dev_data)
+{
+	return dev_data->mbox_ring.hdr ? 0 : -EINVAL;
+}
+
+static void ns9xxx_slave_mbox_detach(struct ns9xxx_i2c *dev_data)
+{
+	/* the ring may still be mapped, it goes with its owner */
+}
+
+static const struct ns9xxx_slave_ops ns9xxx_slave_mbox_ops = {
+	.name		= "mailbox",
+	.attach		= ns9xxx_slave_mbox_attach,
+	.detach		= ns9xxx_slave_mbox_detach,
+	.event		= ns9xxx_slave_mbox_event,
+};
+
+/* NS9XXX_I2C_IOC_SLAVE_MBOX: attach the mailbox at addr for file */
+static int ns9xxx_slave_mbox_claim(struct ns9xxx_i2c *dev_data,
+		struct file *file, unsigned long addr)
+{
+	int ret = 0;
+
+	if (addr > 0x7f)
+		return -EINVAL;
+
+	mutex_lock(&dev_data->slave_lock);
+
+	if (dev_data->mbox_owner && dev_data->mbox_owner != file) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (!dev_data->mbox_ring.hdr) {
+		ret = ns9xxx_ring_alloc(&dev_data->mbox_ring,
+				NS9XXX_MBOX_RING_ENTRIES,
+				sizeof(struct ns9xxx_i2c_frame));
+		if (ret)
+			goto out;
+	}
+	dev_data->mbox_owner = file;
+
+	ret = ns9xxx_slave_attach(dev_data, &ns9xxx_slave_mbox_ops, addr);
+out:
+	mutex_unlock(&dev_data->slave_lock);
+
+	return ret;
+}
+
+/* file is closed, detach and free the mailbox if it is the owner */
+static void ns9xxx_slave_mbox_release(struct ns9xxx_i2c *dev_data,
+		struct file *file)
+{
+	mutex_lock(&dev_data->slave_lock);
+	if (dev_data->mbox_owner == file) {
+		if (dev_data->slave == &ns9xxx_slave_mbox_ops)
+			ns9xxx_slave_detach(dev_data);
+		ns9xxx_ring_free(&dev_data->mbox_ring);
+		dev_data->mbox_owner = NULL;
+	}
+	mutex_unlock(&dev_data->slave_lock);
+}
+
+/* backends that can be attached through sysfs */
+static const struct ns9xxx_slave_ops *ns9xxx_slave_backends[] = {
+	&ns9xxx_slave_eeprom_ops,
+};
+
+
+/*
+ * Periodic sampler
+ *
+ * An hrtimer queues a register read for every entry that is due; the
+ * result is stored in the sample ring directly from the completion in
+ * the interrupt handler. An entry that is still on the bus when it is due
+ * again is skipped and counted as dropped.
+ */
+
+static void ns9xxx_sampler_done(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_xact *xact)
+{
+	struct ns9xxx_sample_slot *slot =
+		container_of(xact, struct ns9xxx_sample_slot, xact);
+	struct ns9xxx_sampler *smp = &dev_data->sampler;
+	struct ns9xxx_i2c_sample *sample;
+
+	slot->busy = 0;
+
+	sample = ns9xxx_ring_produce_start(&smp->ring);
+	if (sample) {
+		sample->timestamp_ns = ktime_to_ns(ktime_get());
+		sample->entry = slot->index;
+		sample->addr = slot->entry.addr;
+		sample->reg = slot->entry.reg;
+		sample->len = slot->entry.len;
+		sample->status = xact->result < 0 ? xact->result : 0;
+		memcpy(sample->data, slot->buf, slot->entry.len);
+		ns9xxx_ring_produce_end(&smp->ring);
+	}
+
+	wake_up(&smp->wait);
+}
+
+static enum hrtimer_restart ns9xxx_sampler_timer(struct hrtimer *timer)
+{
+	struct ns9xxx_i2c *dev_data =
+		container_of(timer, struct ns9xxx_i2c, sampler.timer);
+	struct ns9xxx_sampler *smp = &dev_data->sampler;
+	struct ns9xxx_sample_slot *slot;
+	u64 now, next = ~0ULL;
+	unsigned long flags;
+	int i;
+
+	now = ktime_to_ns(ktime_get());
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+
+	for (i = 0; i < smp->num; i++) {
+		slot = &smp->slots[i];
+
+		if (slot->due <= now) {
+			if (slot->busy)
+				smp->ring.hdr->dropped++;
+			else {
+				slot->busy = 1;
+				ns9xxx_engine_queue(dev_data, &slot->xact);
+			}
+
+			slot->due += (u64)slot->entry.period_us * NSEC_PER_USEC;
+			if (slot->due <= now)
+				slot->due = now + (u64)slot->entry.period_us *
+					NSEC_PER_USEC;
+		}
+
+		if (slot->due < next)
+			next = slot->due;
+	}
+
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	hrtimer_set_expires(timer, ns_to_ktime(next));
+
+	return HRTIMER_RESTART;
+}
+
+static int ns9xxx_sampler_idle(struct ns9xxx_sampler *smp)
+{
+	int i;
+
+	for (i = 0; i < smp->num; i++)
+		if (smp->slots[i].busy)
+			return 0;
+
+	return 1;
+}
+
+static void ns9xxx_sampler_stop(struct ns9xxx_i2c *dev_data)
+{
+	struct ns9xxx_sampler *smp = &dev_data->sampler;
+
+	if (!smp->running)
+		return;
+
+	hrtimer_cancel(&smp->timer);
+	wait_event(smp->wait, ns9xxx_sampler_idle(smp));
+	smp->running = 0;
+
+	kfree(smp->slots);
+	smp->slots = NULL;
+	smp->num = 0;
+}
+
+static int ns9xxx_sampler_start(struct ns9xxx_i2c *dev_data,
+		struct file *file, struct ns9xxx_i2c_sampler __user *uarg)
+{
+	struct ns9xxx_sampler *smp = &dev_data->sampler;
+	struct ns9xxx_i2c_sampler arg;
+	struct ns9xxx_sample_slot *slots, *slot;
+	u64 now;
+	int i, ret;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+
+	if (!arg.num || arg.num > NS9XXX_I2C_SAMPLER_MAX_ENTRIES)
+		return -EINVAL;
+
+	if (smp->owner && (smp->owner != file || smp->running))
+		return -EBUSY;
+
+	/* a stopped sampler keeps its ring, it may still be mapped */
+	if (smp->owner && arg.ring_entries != smp->ring.entries)
+		return -EINVAL;
+
+	slots = kcalloc(arg.num, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	now = ktime_to_ns(ktime_get());
+
+	for (i = 0; i < arg.num; i++) {
+		slot = &slots[i];
+
+		if (copy_from_user(&slot->entry,
+				(void __user *)(unsigned long)arg.entries +
+					i * sizeof(slot->entry),
+				sizeof(slot->entry))) {
+			ret = -EFAULT;
+			goto err_free;
+		}
+
+		if (slot->entry.addr > 0x7f || !slot->entry.len ||
+				slot->entry.len > NS9XXX_I2C_SAMPLE_MAX ||
+				slot->entry.period_us <
+					NS9XXX_SAMPLE_MIN_PERIOD_US) {
+			ret = -EINVAL;
+			goto err_free;
+		}
+
+		slot->index = i;
+		slot->due = now;
+
+		slot->msgs[0].addr = slot->entry.addr;
+		slot->msgs[0].flags = 0;
+		slot->msgs[0].len = 1;
+		slot->msgs[0].buf = &slot->entry.reg;
+		slot->msgs[1].addr = slot->entry.addr;
+		slot->msgs[1].flags = I2C_M_RD;
+		slot->msgs[1].len = slot->entry.len;
+		slot->msgs[1].buf = slot->buf;
+
+		ns9xxx_xact_init(&slot->xact, slot->msgs, 2);
+		slot->xact.complete = ns9xxx_sampler_done;
+	}
+
+	if (!smp->owner) {
+		ret = ns9xxx_ring_alloc(&smp->ring, arg.ring_entries,
+				sizeof(struct ns9xxx_i2c_sample));
+		if (ret)
+			goto err_free;
+		smp->owner = file;
+	}
+
+	smp->slots = slots;
+	smp->num = arg.num;
+	smp->running = 1;
+	hrtimer_start(&smp->timer, ns_to_ktime(now), HRTIMER_MODE_ABS);
+
+	return 0;
+
+err_free:
+	kfree(slots);
+	return ret;
+}
+
+static void ns9xxx_sampler_release(struct ns9xxx_i2c *dev_data,
+		struct file *file)
+{
+	struct ns9xxx_sampler *smp = &dev_data->sampler;
+
+	if (smp->owner != file)
+		return;
+
+	ns9xxx_sampler_stop(dev_data);
+	ns9xxx_ring_free(&smp->ring);
+	smp->owner = NULL;
+}
+
+
+/*
+ * Submission/completion queues
+ *
+ * Submission entries are copied out of the shared SQ ring and queued on
+ * the engine with message buffers pointing into the shared data area, so
+ * data is never copied. Completions are posted to the CQ ring from the
+ * interrupt handler. The number of transactions in flight is limited so
+ * that the CQ ring can never overflow.
+ */
+
+/* xact is NULL for entries that were never queued */
+static void ns9xxx_queue_post(struct ns9xxx_queue *queue, u64 user_data,
+		int result, const struct ns9xxx_xact *xact)
+{
+	struct ns9xxx_i2c_cqe *cqe;
+
+	cqe = ns9xxx_ring_produce_start(&queue->cq);
+	if (cqe) {
+		cqe->user_data = user_data;
+		cqe->result = result;
+		cqe->flags = 0;
+		cqe->ts_addr_ns = xact ? ktime_to_ns(xact->ts_addr) : 0;
+		cqe->ts_stop_ns = xact ? ktime_to_ns(xact->ts_stop) : 0;
+		ns9xxx_ring_produce_end(&queue->cq);
+	}
+
+	wake_up(&queue->wait);
+	if (queue->eventfd)
+		eventfd_signal(queue->eventfd, 1);
+}
+
+static void ns9xxx_queue_done(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_xact *xact)
+{
+	struct ns9xxx_queue_req *req =
+		container_of(xact, struct ns9xxx_queue_req, xact);
+	struct ns9xxx_queue *queue = req->queue;
+
+	queue->inflight--;
+	list_add(&req->xact.list, &queue->free);
+	ns9xxx_queue_post(queue, req->user_data, xact->result, xact);
+}
+
+/* fill req from a submission entry, returns 0 or -errno for the CQE */
+static int ns9xxx_queue_prep(struct ns9xxx_queue *queue,
+		struct ns9xxx_queue_req *req, const struct ns9xxx_i2c_sqe *sqe)
+{
+	const struct ns9xxx_i2c_sqe_msg *m;
+	int i, ret;
+
+	if (!sqe->nmsgs || sqe->nmsgs > NS9XXX_I2C_SQE_MAX_MSGS)
+		return -EINVAL;
+
+	for (i = 0; i < sqe->nmsgs; i++) {
+		m = &sqe->msgs[i];
+
+		if (m->offset > queue->data_size ||
+				m->len > queue->data_size - m->offset)
+			return -EINVAL;
+
+		if (m->addr > ((m->flags & I2C_M_TEN) ? 0x3ff : 0x7f))
+			return -EINVAL;
+
+		req->msgs[i].addr = m->addr;
+		req->msgs[i].flags = m->flags;
+		req->msgs[i].len = m->len;
+		req->msgs[i].buf = queue->data + m->offset;
+	}
+
+	ret = ns9xxx_xact_check(req->msgs, sqe->nmsgs);
+	if (ret)
+		return ret;
+
+	ns9xxx_xact_init(&req->xact, req->msgs, sqe->nmsgs);
+	req->xact.complete = ns9xxx_queue_done;
+	req->user_data = sqe->user_data;
+
+	ns9xxx_xact_set_deadline(&req->xact, sqe->deadline_us);
+
+	return ns9xxx_xact_set_flags(&req->xact, sqe->flags);
+}
+
+static int ns9xxx_queue_submit(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_queue *queue)
+{
+	struct ns9xxx_ring *sq = &queue->sq;
+	struct ns9xxx_i2c_sqe sqe;
+	struct ns9xxx_queue_req *req;
+	unsigned long flags;
+	u32 head;
+	int submitted = 0, ret;
+
+	head = ns9xxx_ring_user_head(sq);
+	smp_rmb();
+
+	while (sq->tail != head) {
+		/* userspace may keep writing the ring, work on a copy */
+		memcpy(&sqe, ns9xxx_ring_entry(sq, sq->tail), sizeof(sqe));
+
+		spin_lock_irqsave(&dev_data->lock, flags);
+		if (list_empty(&queue->free) || queue->inflight +
+				ns9xxx_ring_used(&queue->cq) >=
+				queue->cq.entries) {
+			spin_unlock_irqrestore(&dev_data->lock, flags);
+			break;
+		}
+		req = list_first_entry(&queue->free, struct ns9xxx_queue_req,
+				xact.list);
+		list_del(&req->xact.list);
+		spin_unlock_irqrestore(&dev_data->lock, flags);
+
+		ret = ns9xxx_queue_prep(queue, req, &sqe);
+		if (!ret)
+			ns9xxx_wb_order(dev_data, req->msgs, sqe.nmsgs);
 
 		spin_lock_irqsave(&dev_data->lock, flags);
-		dev_data->buf = buf;
+		if (ret) {
+			list_add(&req->xact.list, &queue->free);
+			ns9xxx_queue_post(queue, sqe.user_data, ret, NULL);
+		} else {
+			queue->inflight++;
+			ns9xxx_engine_queue(dev_data, &req->xact);
+		}
 		spin_unlock_irqrestore(&dev_data->lock, flags);
 
-		if (msgs[i].len == 0) {
-			/* send using use bitbang mode */
-			ret = ns9xxx_i2c_bitbang(dev_data, &msgs[i]);
-		} else {
-			if (!(msgs[i].flags & I2C_M_NOSTART)) {
-				/* set device address */
-				reg = ((msgs[i].addr & I2C_MASTERADDR_ADDRMASK)
-						<< I2C_MASTERADDR_ADDRSHIFT);
-
-				if (msgs[i].flags & I2C_M_TEN)
-					reg |= I2C_MASTERADDR_10BIT;
-				else
-					reg |= I2C_MASTERADDR_7BIT;
-
-				spin_lock_irqsave(&dev_data->lock, flags);
-				writel(reg, dev_data->ioaddr +
-						I2C_MASTERADDR);
-				spin_unlock_irqrestore(&dev_data->lock, flags);
-
-				if (msgs[i].flags & I2C_M_RD)
-					cmd = I2C_CMD_READ;
-				else {
-					cmd = I2C_CMD_WRITE | I2C_CMD_TXVAL;
-					cmd |= *buf;
-					len--;
-					buf++;
-				}
-
-				ret = ns9xxx_i2c_send_cmd(dev_data, cmd);
-				if (ret) {
-					if (dev_data->state == I2C_INT_RETRY) {
-						i = 0;
-						continue;
-					}
-					break;
-				}
-			}
+		sq->tail++;
+		sq->hdr->tail = sq->tail;
+		submitted++;
+	}
+
+	return submitted ? submitted : -EBUSY;
+}
+
+static void ns9xxx_queue_free(struct ns9xxx_queue *queue)
+{
+	if (queue->eventfd)
+		eventfd_ctx_put(queue->eventfd);
+	vfree(queue->data);
+	ns9xxx_ring_free(&queue->cq);
+	ns9xxx_ring_free(&queue->sq);
+	kfree(queue->reqs);
+	kfree(queue);
+}
+
+static int ns9xxx_queue_setup(struct ns9xxx_i2c_file *priv,
+		struct ns9xxx_i2c_queue_setup __user *uarg)
+{
+	struct ns9xxx_i2c_queue_setup arg;
+	struct ns9xxx_queue *queue;
+	int i, ret;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+
+	if (priv->queue)
+		return -EBUSY;
+
+	if (!arg.data_size || arg.data_size > NS9XXX_QUEUE_MAX_DATA)
+		return -EINVAL;
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+	if (!queue)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&queue->free);
+	init_waitqueue_head(&queue->wait);
+
+	ret = ns9xxx_ring_alloc(&queue->sq, arg.sq_entries,
+			sizeof(struct ns9xxx_i2c_sqe));
+	if (ret)
+		goto err_free;
+
+	ret = ns9xxx_ring_alloc(&queue->cq, arg.cq_entries,
+			sizeof(struct ns9xxx_i2c_cqe));
+	if (ret)
+		goto err_free;
+
+	ret = -ENOMEM;
+	queue->data_size = arg.data_size;
+	queue->data_mapsize = PAGE_ALIGN(arg.data_size);
+	queue->data = vmalloc_user(queue->data_mapsize);
+	if (!queue->data)
+		goto err_free;
+
+	queue->reqs = kcalloc(arg.cq_entries, sizeof(*queue->reqs),
+			GFP_KERNEL);
+	if (!queue->reqs)
+		goto err_free;
+	for (i = 0; i < arg.cq_entries; i++) {
+		queue->reqs[i].queue = queue;
+		list_add_tail(&queue->reqs[i].xact.list, &queue->free);
+	}
+
+	if (arg.eventfd >= 0) {
+		queue->eventfd = eventfd_ctx_fdget(arg.eventfd);
+		if (IS_ERR(queue->eventfd)) {
+			ret = PTR_ERR(queue->eventfd);
+			queue->eventfd = NULL;
+			goto err_free;
+		}
+	}
+
+	priv->queue = queue;
+
+	return 0;
+
+err_free:
+	ns9xxx_queue_free(queue);
+	return ret;
+}
+
+static void ns9xxx_queue_release(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_queue *queue)
+{
+	/* the engine completes or times out everything in flight */
+	wait_event(queue->wait, ACCESS_ONCE(queue->inflight) == 0);
+	ns9xxx_queue_free(queue);
+}
+
+
+/*
+ * Batched transfers
+ *
+ * Every transaction of the batch is validated and copied in first, then
+ * all of them are queued on the engine in one go so they run back to back,
+ * and the results are collected per transaction.
+ */
+
+struct ns9xxx_batch_req {
+	struct ns9xxx_xact	xact;
+	struct i2c_msg		*umsgs;		/* as passed in, user buffers */
+	struct i2c_msg		*msgs;		/* kernel buffers */
+	int			nmsgs;
+	int			status;		/* validation result */
+};
+
+static int ns9xxx_batch_prep(struct ns9xxx_batch_req *req,
+		const struct ns9xxx_i2c_batch_xfer *xfer)
+{
+	int i, ret;
+
+	if (!xfer->nmsgs || xfer->nmsgs > NS9XXX_I2C_BATCH_MAX_MSGS)
+		return -EINVAL;
+
+	req->umsgs = memdup_user((void __user *)(unsigned long)xfer->msgs,
+			xfer->nmsgs * sizeof(struct i2c_msg));
+	if (IS_ERR(req->umsgs)) {
+		i = PTR_ERR(req->umsgs);
+		req->umsgs = NULL;
+		return i;
+	}
+
+	req->msgs = kcalloc(xfer->nmsgs, sizeof(struct i2c_msg), GFP_KERNEL);
+	if (!req->msgs)
+		return -ENOMEM;
+	req->nmsgs = xfer->nmsgs;
+
+	ret = ns9xxx_xact_check(req->umsgs, req->nmsgs);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < req->nmsgs; i++) {
+		req->msgs[i] = req->umsgs[i];
+
+		if (req->msgs[i].flags & I2C_M_RD)
+			req->msgs[i].buf = kmalloc(req->msgs[i].len,
+					GFP_KERNEL);
+		else
+			req->msgs[i].buf = memdup_user(
+					(void __user *)req->umsgs[i].buf,
+					req->msgs[i].len);
+		if (IS_ERR_OR_NULL(req->msgs[i].buf)) {
+			int ret = req->msgs[i].buf ?
+				PTR_ERR(req->msgs[i].buf) : -ENOMEM;
+
+			req->msgs[i].buf = NULL;
+			return ret;
+		}
+	}
+
+	ns9xxx_xact_init(&req->xact, req->msgs, req->nmsgs);
+
+	ns9xxx_xact_set_deadline(&req->xact, xfer->deadline_us);
+
+	return ns9xxx_xact_set_flags(&req->xact, xfer->flags);
+}
+
+static int ns9xxx_batch_finish(struct ns9xxx_batch_req *req,
+		struct ns9xxx_i2c_batch_xfer *xfer)
+{
+	int i, ret = 0;
+
+	xfer->status = req->status ? req->status : req->xact.result;
+	xfer->bytes = req->status ? 0 : req->xact.bytes;
+	xfer->ts_addr_ns = req->status ? 0 : ktime_to_ns(req->xact.ts_addr);
+	xfer->ts_stop_ns = req->status ? 0 : ktime_to_ns(req->xact.ts_stop);
+
+	for (i = 0; i < req->nmsgs; i++) {
+		if (!req->status && (req->msgs[i].flags & I2C_M_RD) &&
+				copy_to_user((void __user *)req->umsgs[i].buf,
+					req->msgs[i].buf, req->msgs[i].len))
+			ret = -EFAULT;
+		kfree(req->msgs[i].buf);
+	}
+	kfree(req->msgs);
+	kfree(req->umsgs);
+
+	return ret;
+}
+
+static int ns9xxx_batch_run(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_i2c_batch __user *uarg)
+{
+	struct ns9xxx_i2c_batch batch;
+	struct ns9xxx_i2c_batch_xfer *xfers;
+	struct ns9xxx_batch_req *reqs;
+	unsigned long flags;
+	int i, ret = 0;
+
+	if (copy_from_user(&batch, uarg, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.num || batch.num > NS9XXX_I2C_BATCH_MAX)
+		return -EINVAL;
+
+	xfers = memdup_user((void __user *)(unsigned long)batch.xfers,
+			batch.num * sizeof(*xfers));
+	if (IS_ERR(xfers))
+		return PTR_ERR(xfers);
+
+	reqs = kcalloc(batch.num, sizeof(*reqs), GFP_KERNEL);
+	if (!reqs) {
+		kfree(xfers);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < batch.num; i++) {
+		reqs[i].status = ns9xxx_batch_prep(&reqs[i], &xfers[i]);
+		if (reqs[i].status == -EFAULT || reqs[i].status == -ENOMEM) {
+			/* nothing has been queued, just clean up */
+			ret = reqs[i].status;
+			batch.num = i + 1;
+			while (i--)
+				reqs[i].status = ret;
+			goto out_finish;
+		}
+	}
+
+	i2c_lock_adapter(&dev_data->adap);
+
+	for (i = 0; i < batch.num; i++)
+		if (!reqs[i].status)
+			ns9xxx_wb_order(dev_data, reqs[i].msgs, reqs[i].nmsgs);
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	for (i = 0; i < batch.num; i++)
+		if (!reqs[i].status)
+			ns9xxx_engine_queue(dev_data, &reqs[i].xact);
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	for (i = 0; i < batch.num; i++)
+		if (!reqs[i].status)
+			wait_for_completion(&reqs[i].xact.done);
+
+	i2c_unlock_adapter(&dev_data->adap);
+
+out_finish:
+	batch.failed = 0;
+	for (i = 0; i < batch.num; i++) {
+		if (ns9xxx_batch_finish(&reqs[i], &xfers[i]))
+			ret = -EFAULT;
+		if (xfers[i].status < 0)
+			batch.failed++;
+	}
+
+	if (!ret && (copy_to_user((void __user *)(unsigned long)batch.xfers,
+				xfers, batch.num * sizeof(*xfers)) ||
+			copy_to_user(uarg, &batch, sizeof(batch))))
+		ret = -EFAULT;
+
+	kfree(reqs);
+	kfree(xfers);
+
+	return ret;
+}
+
+
+/*
+ * Transaction scripts
+ *
+ * Everything that could go wrong with a script's memory accesses is
+ * checked once at load time, so the interpreter only has to deal with bus
+ * errors, signals and the run time limit.
+ */
+
+/* sleep with the adapter locked, -EINTR if a signal comes in */
+static int ns9xxx_usleep(unsigned int us)
+{
+	ktime_t kt = ktime_set(0, (u64)us * NSEC_PER_USEC);
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	schedule_hrtimeout(&kt, HRTIMER_MODE_REL);
+
+	return signal_pending(current) ? -EINTR : 0;
+}
+
+static int ns9xxx_script_check(const struct ns9xxx_i2c_insn *insns, u32 n)
+{
+	const struct ns9xxx_i2c_insn *insn;
+	u64 wait_us = 0;
+	int loops = 0;
+	u32 i;
+
+	for (i = 0; i < n; i++) {
+		insn = &insns[i];
+
+		switch (insn->op) {
+		case NS9XXX_I2C_OP_END:
+			if (insn->arg > INT_MAX)
+				return -EINVAL;
+			break;
+		case NS9XXX_I2C_OP_CMP:
+		case NS9XXX_I2C_OP_MODIFY:
+			break;
+		case NS9XXX_I2C_OP_POLL:
+			if (!insn->rd_len ||
+					insn->arg > NS9XXX_I2C_SCRIPT_MAX_WAIT_US)
+				return -EINVAL;
+			wait_us += insn->arg;
+			/* fall through */
+		case NS9XXX_I2C_OP_XFER:
+			if (insn->addr > 0x7f ||
+					(!insn->wr_len && !insn->rd_len) ||
+					insn->wr_off + insn->wr_len >
+						NS9XXX_I2C_SCRIPT_SCRATCH ||
+					insn->rd_off + insn->rd_len >
+						NS9XXX_I2C_SCRIPT_SCRATCH)
+				return -EINVAL;
+			break;
+		case NS9XXX_I2C_OP_USLEEP:
+			if (insn->arg > NS9XXX_I2C_SCRIPT_MAX_WAIT_US)
+				return -EINVAL;
+			wait_us += insn->arg;
+			break;
+		case NS9XXX_I2C_OP_JUMP:
+			if (insn->arg >= n ||
+					insn->cond > NS9XXX_I2C_JUMP_IF_CLEAR)
+				return -EINVAL;
+			if (insn->arg <= i)
+				loops = 1;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	/* without loops every wait happens at most once */
+	if (!loops && wait_us > NS9XXX_I2C_SCRIPT_MAX_RUN_US)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int ns9xxx_script_load(struct ns9xxx_i2c_file *priv,
+		struct ns9xxx_i2c_script __user *uarg)
+{
+	struct ns9xxx_i2c_script arg;
+	struct ns9xxx_i2c_insn *insns = NULL;
+	int ret;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.slot >= NS9XXX_I2C_SCRIPT_SLOTS ||
+			arg.ninsns > NS9XXX_I2C_SCRIPT_MAX_INSNS)
+		return -EINVAL;
+
+	if (arg.ninsns) {
+		insns = memdup_user((void __user *)(unsigned long)arg.insns,
+				arg.ninsns * sizeof(*insns));
+		if (IS_ERR(insns))
+			return PTR_ERR(insns);
+
+		ret = ns9xxx_script_check(insns, arg.ninsns);
+		if (ret) {
+			kfree(insns);
+			return ret;
+		}
+	}
+
+	kfree(priv->scripts[arg.slot].insns);
+	priv->scripts[arg.slot].insns = insns;
+	priv->scripts[arg.slot].ninsns = arg.ninsns;
+
+	return 0;
+}
+
+static int ns9xxx_script_xfer(struct ns9xxx_i2c *dev_data,
+		const struct ns9xxx_i2c_insn *insn, u8 *scratch)
+{
+	struct ns9xxx_xact xact;
+	struct i2c_msg msgs[2];
+	int num = 0;
+
+	if (insn->wr_len) {
+		msgs[num].addr = insn->addr;
+		msgs[num].flags = 0;
+		msgs[num].len = insn->wr_len;
+		msgs[num].buf = scratch + insn->wr_off;
+		num++;
+	}
+	if (insn->rd_len) {
+		msgs[num].addr = insn->addr;
+		msgs[num].flags = I2C_M_RD;
+		msgs[num].len = insn->rd_len;
+		msgs[num].buf = scratch + insn->rd_off;
+		num++;
+	}
+
+	ns9xxx_wb_order(dev_data, msgs, num);
+	ns9xxx_xact_init(&xact, msgs, num);
+
+	return ns9xxx_engine_run(dev_data, &xact);
+}
+
+static int ns9xxx_script_exec(struct ns9xxx_i2c *dev_data,
+		const struct ns9xxx_script *script, u8 *scratch, u32 *pc)
+{
+	const struct ns9xxx_i2c_insn *insn;
+	int steps, flag = 0, ret;
+	ktime_t start, end;
+	s64 left;
+
+	end = ktime_add_us(ktime_get(), NS9XXX_I2C_SCRIPT_MAX_RUN_US);
+
+	for (steps = 0; steps < NS9XXX_SCRIPT_MAX_STEPS; steps++) {
+		if (*pc >= script->ninsns)
+			return 0;
+		if (signal_pending(current))
+			return -EINTR;
+		left = ktime_us_delta(end, ktime_get());
+		if (left <= 0)
+			return -ETIME;
+
+		insn = &script->insns[*pc];
+
+		switch (insn->op) {
+		case NS9XXX_I2C_OP_END:
+			return insn->arg;
+		case NS9XXX_I2C_OP_XFER:
+			ret = ns9xxx_script_xfer(dev_data, insn, scratch);
+			if (ret < 0)
+				return ret;
+			break;
+		case NS9XXX_I2C_OP_CMP:
+			flag = (scratch[insn->rd_off] & insn->mask) ==
+				insn->value;
+			break;
+		case NS9XXX_I2C_OP_MODIFY:
+			scratch[insn->wr_off] =
+				(scratch[insn->wr_off] & insn->mask) |
+				insn->value;
+			break;
+		case NS9XXX_I2C_OP_POLL:
+			start = ktime_get();
+			for (;;) {
+				ret = ns9xxx_script_xfer(dev_data, insn,
+						scratch);
+				flag = ret >= 0 &&
+					(scratch[insn->rd_off] & insn->mask) ==
+						insn->value;
+				if (flag || ktime_us_delta(ktime_get(), start) >=
+						min_t(s64, insn->arg, left))
+					break;
+				if (signal_pending(current))
+					return -EINTR;
+				if (insn->interval_us &&
+						ns9xxx_usleep(insn->interval_us))
+					return -EINTR;
+			}
+			break;
+		case NS9XXX_I2C_OP_USLEEP:
+			if (ns9xxx_usleep(min_t(s64, insn->arg, left)))
+				return -EINTR;
+			break;
+		case NS9XXX_I2C_OP_JUMP:
+			if (insn->cond == NS9XXX_I2C_JUMP_ALWAYS ||
+					(insn->cond == NS9XXX_I2C_JUMP_IF_SET &&
+						flag) ||
+					(insn->cond == NS9XXX_I2C_JUMP_IF_CLEAR &&
+						!flag)) {
+				*pc = insn->arg;
+				continue;
+			}
+			break;
+		}
+
+		(*pc)++;
+	}
+
+	return -ELOOP;
+}
+
+static int ns9xxx_script_run(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_i2c_file *priv,
+		struct ns9xxx_i2c_script_run __user *uarg)
+{
+	struct ns9xxx_i2c_script_run arg;
+	struct ns9xxx_script *script;
+	u8 *scratch;
+	int ret = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.slot >= NS9XXX_I2C_SCRIPT_SLOTS)
+		return -EINVAL;
+	script = &priv->scripts[arg.slot];
+	if (!script->insns)
+		return -ENOENT;
+
+	scratch = memdup_user((void __user *)(unsigned long)arg.scratch,
+			NS9XXX_I2C_SCRIPT_SCRATCH);
+	if (IS_ERR(scratch))
+		return PTR_ERR(scratch);
+
+	arg.pc = 0;
+
+	i2c_lock_adapter(&dev_data->adap);
+	arg.result = ns9xxx_script_exec(dev_data, script, scratch, &arg.pc);
+	i2c_unlock_adapter(&dev_data->adap);
+
+	if (copy_to_user((void __user *)(unsigned long)arg.scratch, scratch,
+				NS9XXX_I2C_SCRIPT_SCRATCH) ||
+			copy_to_user(uarg, &arg, sizeof(arg)))
+		ret = -EFAULT;
+
+	kfree(scratch);
+
+	return ret;
+}
+
+
+/*
+ * Bulk EEPROM access
+ *
+ * Two transactions are kept queued, so the next page write is already
+ * polling for the end of the current write cycle when it completes, and
+ * the next read starts right after the STOP of the previous one. When one
+ * fails, the one queued behind it is taken off the queue before it can
+ * start, and nothing more is queued.
+ */
+
+#define NS9XXX_EEPROM_WINDOW		2
+#define NS9XXX_EEPROM_READ_CHUNK	0xffff
+
+struct ns9xxx_eeprom_win;
+
+struct ns9xxx_eeprom_req {
+	struct ns9xxx_xact	xact;
+	struct i2c_msg		msgs[2];
+	u8			maddr[2];
+	u8			*buf;
+	u32			offset;		/* of the data in the range */
+	u32			len;
+	struct ns9xxx_eeprom_win *win;
+	int			pending;	/* queued, under dev_data->lock */
+};
+
+struct ns9xxx_eeprom_win {
+	struct ns9xxx_eeprom_req req[NS9XXX_EEPROM_WINDOW];
+	int			failed;		/* under dev_data->lock */
+};
+
+/* called with dev_data->lock held */
+static void ns9xxx_eeprom_complete(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_xact *xact)
+{
+	struct ns9xxx_eeprom_req *req =
+		container_of(xact, struct ns9xxx_eeprom_req, xact);
+	struct ns9xxx_eeprom_win *win = req->win;
+	struct ns9xxx_eeprom_req *next;
+	int i;
+
+	req->pending = 0;
+
+	if (xact->result < 0 && !win->failed) {
+		win->failed = 1;
+		/* the engine runs one at a time: the others have not started */
+		for (i = 0; i < NS9XXX_EEPROM_WINDOW; i++) {
+			next = &win->req[i];
+			if (!next->pending)
+				continue;
+			list_del(&next->xact.list);
+			dev_data->queued_ns[next->xact.prio] -=
+				next->xact.wire_ns;
+			next->pending = 0;
+			next->xact.result = -ECANCELED;
+			ns9xxx_xact_wake(dev_data, &next->xact);
+		}
+	}
+
+	ns9xxx_xact_wake(dev_data, xact);
+}
+
+static void ns9xxx_eeprom_submit(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_eeprom_req *req)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	if (req->win->failed) {
+		req->xact.result = -ECANCELED;
+		ns9xxx_xact_wake(dev_data, &req->xact);
+	} else {
+		req->pending = 1;
+		ns9xxx_engine_queue(dev_data, &req->xact);
+	}
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+}
+
+/* set up the transaction for len bytes at memory address mem */
+static int ns9xxx_eeprom_prep(struct ns9xxx_eeprom_req *req,
+		const struct ns9xxx_i2c_eeprom *arg, u32 mem, u32 len)
+{
+	u8 *maddr = arg->write ? req->buf : req->maddr;
+	u16 addr = arg->addr + (mem >> (8 * arg->addr_len));
+	int i;
+
+	for (i = 0; i < arg->addr_len; i++)
+		maddr[i] = mem >> (8 * (arg->addr_len - 1 - i));
+
+	req->offset = mem - arg->offset;
+	req->len = len;
+
+	req->msgs[0].addr = addr;
+	req->msgs[0].flags = 0;
+
+	if (arg->write) {
+		if (copy_from_user(req->buf + arg->addr_len,
+				(void __user *)(unsigned long)arg->buf +
+					req->offset, len))
+			return -EFAULT;
+
+		req->msgs[0].len = arg->addr_len + len;
+		req->msgs[0].buf = req->buf;
+		ns9xxx_xact_init(&req->xact, req->msgs, 1);
+
+		/* wait out the write cycle of the previous page */
+		req->xact.flags |= NS9XXX_XACT_ACKPOLL;
+		req->xact.ackpoll_ns = ns9xxx_param_ns(&ackpoll_timeout,
+				NS9XXX_ACKPOLL_TIMEOUT_MAX_MS, NSEC_PER_MSEC);
+		req->xact.qos = NS9XXX_QOS_BULK;
+	} else {
+		req->msgs[0].len = arg->addr_len;
+		req->msgs[0].buf = req->maddr;
+		req->msgs[1].addr = addr;
+		req->msgs[1].flags = I2C_M_RD;
+		req->msgs[1].len = len;
+		req->msgs[1].buf = req->buf;
+		ns9xxx_xact_init(&req->xact, req->msgs, 2);
+		req->xact.qos = NS9XXX_QOS_BULK;
+	}
+	req->xact.complete = ns9xxx_eeprom_complete;
+
+	return 0;
+}
+
+/* length of the next chunk at memory address mem */
+static u32 ns9xxx_eeprom_chunk(const struct ns9xxx_i2c_eeprom *arg, u32 mem)
+{
+	u32 left = arg->offset + arg->len - mem;
+	u32 boundary;
+
+	if (arg->write)
+		boundary = arg->page_size;
+	else
+		boundary = 1 << (8 * arg->addr_len);
+
+	return min3(left, boundary - (mem & (boundary - 1)),
+			(u32)NS9XXX_EEPROM_READ_CHUNK);
+}
+
+static int ns9xxx_eeprom_run(struct ns9xxx_i2c *dev_data,
+		struct ns9xxx_i2c_eeprom __user *uarg)
+{
+	struct ns9xxx_i2c_eeprom arg;
+	struct ns9xxx_eeprom_win *win;
+	struct ns9xxx_eeprom_req *req;
+	unsigned int head = 0, tail = 0;
+	u32 mem, chunk, bufsize;
+	ktime_t start;
+	int i, ret = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.addr > 0x7f || arg.addr_len < 1 || arg.addr_len > 2 ||
+			!arg.len || arg.len > NS9XXX_I2C_EEPROM_MAX_LEN ||
+			arg.offset + arg.len < arg.offset)
+		return -EINVAL;
+	if (arg.addr + ((arg.offset + arg.len - 1) >> (8 * arg.addr_len)) >
+			0x7f)
+		return -EINVAL;
+	if (arg.write && (!arg.page_size ||
+			arg.page_size > NS9XXX_I2C_EEPROM_MAX_PAGE ||
+			(arg.page_size & (arg.page_size - 1))))
+		return -EINVAL;
+	/* a page must not cross into the next device address */
+	if (arg.write && arg.page_size > 1 << (8 * arg.addr_len))
+		return -EINVAL;
+
+	if (arg.write)
+		bufsize = arg.addr_len + arg.page_size;
+	else
+		bufsize = min_t(u32, arg.len, NS9XXX_EEPROM_READ_CHUNK);
+
+	win = kzalloc(sizeof(*win), GFP_KERNEL);
+	if (!win)
+		return -ENOMEM;
+	for (i = 0; i < NS9XXX_EEPROM_WINDOW; i++) {
+		win->req[i].win = win;
+		win->req[i].buf = vmalloc(bufsize);
+		if (!win->req[i].buf) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	arg.done = 0;
+	arg.wire_ns = 0;
+	mem = arg.offset;
+
+	i2c_lock_adapter(&dev_data->adap);
+	start = ktime_get();
+
+	for (;;) {
+		while (!ret && mem < arg.offset + arg.len &&
+				head - tail < NS9XXX_EEPROM_WINDOW) {
+			req = &win->req[head % NS9XXX_EEPROM_WINDOW];
+			chunk = ns9xxx_eeprom_chunk(&arg, mem);
+
+			ret = ns9xxx_eeprom_prep(req, &arg, mem, chunk);
+			if (ret)
+				break;
+
+			arg.wire_ns += ns9xxx_wire_ns(dev_data, req->msgs,
+					req->xact.num);
+			ns9xxx_wb_order(dev_data, req->msgs, req->xact.num);
+			ns9xxx_eeprom_submit(dev_data, req);
+			mem += chunk;
+			head++;
+		}
+
+		if (head == tail)
+			break;
+
+		req = &win->req[tail % NS9XXX_EEPROM_WINDOW];
+		wait_for_completion(&req->xact.done);
+		tail++;
+
+		if (req->xact.result < 0) {
+			if (!ret)
+				ret = req->xact.result;
+			continue;
+		}
+
+		/* only count what made it, in order */
+		if (!ret && !arg.write &&
+				copy_to_user((void __user *)(unsigned long)arg.buf +
+					req->offset, req->buf, req->len))
+			ret = -EFAULT;
+		if (!ret)
+			arg.done += req->len;
+	}
+
+	arg.elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	i2c_unlock_adapter(&dev_data->adap);
+
+	if (copy_to_user(uarg, &arg, sizeof(arg)))
+		ret = -EFAULT;
+
+out_free:
+	for (i = 0; i < NS9XXX_EEPROM_WINDOW; i++)
+		vfree(win->req[i].buf);
+	kfree(win);
+
+	return ret;
+}
+
+
+/*
+ * character device
+ *
+ * Every open file holds a reference on dev_data and its platform device,
+ * so the hardware is only released when the last one is closed; once the
+ * adapter is removed the calls on them fail with -ENODEV.
+ */
+
+static void ns9xxx_i2c_get(struct ns9xxx_i2c *dev_data)
+{
+	get_device(dev_data->dev);
+	kref_get(&dev_data->ref);
+}
+
+static void ns9xxx_i2c_put(struct ns9xxx_i2c *dev_data)
+{
+	struct device *dev = dev_data->dev;
+
+	kref_put(&dev_data->ref, ns9xxx_i2c_free);
+	put_device(dev);
+}
+
+static int ns9xxx_i2c_dev_open(struct inode *inode, struct file *file)
+{
+	struct ns9xxx_i2c *dev_data;
+	struct ns9xxx_i2c_file *priv;
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+
+	mutex_lock(&ns9xxx_i2c_devices_lock);
+	list_for_each_entry(dev_data, &ns9xxx_i2c_devices, node) {
+		if (dev_data->miscdev.minor == iminor(inode)) {
+			ns9xxx_i2c_get(dev_data);
+			priv->dev_data = dev_data;
+			break;
+		}
+	}
+	mutex_unlock(&ns9xxx_i2c_devices_lock);
+
+	if (!priv->dev_data) {
+		kfree(priv);
+		return -ENODEV;
+	}
+
+	mutex_init(&priv->lock);
+	file->private_data = priv;
+
+	return 0;
+}
+
+static int ns9xxx_i2c_dev_release(struct inode *inode, struct file *file)
+{
+	struct ns9xxx_i2c_file *priv = file->private_data;
+	struct ns9xxx_i2c *dev_data = priv->dev_data;
+	int i;
+
+	mutex_lock(&dev_data->ioctl_lock);
+	ns9xxx_sampler_release(dev_data, file);
+	mutex_unlock(&dev_data->ioctl_lock);
+
+	ns9xxx_slave_mbox_release(dev_data, file);
+
+	if (priv->queue)
+		ns9xxx_queue_release(dev_data, priv->queue);
+	for (i = 0; i < NS9XXX_I2C_SCRIPT_SLOTS; i++)
+		kfree(priv->scripts[i].insns);
+	kfree(priv);
+
+	ns9xxx_i2c_put(dev_data);
+
+	return 0;
+}
+
+static long ns9xxx_i2c_dev_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
+{
+	struct ns9xxx_i2c_file *priv = file->private_data;
+	struct ns9xxx_i2c *dev_data = priv->dev_data;
+	long ret;
+
+	if (ACCESS_ONCE(dev_data->dead))
+		return -ENODEV;
+
+	/* adapter-wide state */
+	switch (cmd) {
+	case NS9XXX_I2C_IOC_SAMPLER_START:
+		mutex_lock(&dev_data->ioctl_lock);
+		ret = ns9xxx_sampler_start(dev_data, file,
+				(struct ns9xxx_i2c_sampler __user *)arg);
+		mutex_unlock(&dev_data->ioctl_lock);
+		return ret;
+	case NS9XXX_I2C_IOC_SAMPLER_STOP:
+		mutex_lock(&dev_data->ioctl_lock);
+		ret = -EPERM;
+		if (dev_data->sampler.owner == file) {
+			ns9xxx_sampler_stop(dev_data);
+			ret = 0;
+		}
+		mutex_unlock(&dev_data->ioctl_lock);
+		return ret;
+	case NS9XXX_I2C_IOC_BATCH:
+		return ns9xxx_batch_run(dev_data,
+				(struct ns9xxx_i2c_batch __user *)arg);
+	case NS9XXX_I2C_IOC_EEPROM:
+		return ns9xxx_eeprom_run(dev_data,
+				(struct ns9xxx_i2c_eeprom __user *)arg);
+	case NS9XXX_I2C_IOC_SLAVE_MBOX:
+		return ns9xxx_slave_mbox_claim(dev_data, file, arg);
+	}
+
+	/* per-file state */
+	mutex_lock(&priv->lock);
+
+	switch (cmd) {
+	case NS9XXX_I2C_IOC_QUEUE_SETUP:
+		ret = ns9xxx_queue_setup(priv,
+				(struct ns9xxx_i2c_queue_setup __user *)arg);
+		break;
+	case NS9XXX_I2C_IOC_QUEUE_SUBMIT:
+		ret = -EINVAL;
+		if (priv->queue)
+			ret = ns9xxx_queue_submit(dev_data, priv->queue);
+		break;
+	case NS9XXX_I2C_IOC_SCRIPT_LOAD:
+		ret = ns9xxx_script_load(priv,
+				(struct ns9xxx_i2c_script __user *)arg);
+		break;
+	case NS9XXX_I2C_IOC_SCRIPT_RUN:
+		ret = ns9xxx_script_run(dev_data, priv,
+				(struct ns9xxx_i2c_script_run __user *)arg);
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+
+	mutex_unlock(&priv->lock);
+
+	return ret;
+}
+
+/* read() returns whole struct ns9xxx_i2c_sample records */
+static ssize_t ns9xxx_i2c_dev_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct ns9xxx_i2c_file *priv = file->private_data;
+	struct ns9xxx_i2c *dev_data = priv->dev_data;
+	struct ns9xxx_sampler *smp = &dev_data->sampler;
+	ssize_t ret;
+
+	if (smp->owner != file)
+		return -EPERM;
+
+	if (count < sizeof(struct ns9xxx_i2c_sample))
+		return -EINVAL;
+
+	while (ns9xxx_ring_empty(&smp->ring)) {
+		if (ACCESS_ONCE(dev_data->dead))
+			return -ENODEV;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(smp->wait,
+				!ns9xxx_ring_empty(&smp->ring) ||
+				ACCESS_ONCE(dev_data->dead));
+		if (ret)
+			return ret;
+	}
+
+	return ns9xxx_ring_read(&smp->ring, buf, count);
+}
+
+static unsigned int ns9xxx_i2c_dev_poll(struct file *file, poll_table *wait)
+{
+	struct ns9xxx_i2c_file *priv = file->private_data;
+	struct ns9xxx_i2c *dev_data = priv->dev_data;
+	struct ns9xxx_sampler *smp = &dev_data->sampler;
+	unsigned int mask = 0;
+
+	poll_wait(file, &smp->wait, wait);
+	if (ACCESS_ONCE(dev_data->dead))
+		return POLLERR | POLLHUP;
+	if (smp->owner == file && !ns9xxx_ring_empty(&smp->ring))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (priv->queue) {
+		poll_wait(file, &priv->queue->wait, wait);
+		if (!ns9xxx_ring_empty(&priv->queue->cq))
+			mask |= POLLIN | POLLRDNORM;
+	}
+
+	/* mbox_owner only changes from this file's ioctl() and release() */
+	if (dev_data->mbox_owner == file) {
+		poll_wait(file, &dev_data->mbox_wait, wait);
+		if (!ns9xxx_ring_empty(&dev_data->mbox_ring))
+			mask |= POLLIN | POLLRDNORM;
+	}
+
+	return mask;
+}
+
+static int ns9xxx_i2c_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ns9xxx_i2c_file *priv = file->private_data;
+	struct ns9xxx_i2c *dev_data = priv->dev_data;
+	unsigned long long off = (unsigned long long)vma->vm_pgoff << PAGE_SHIFT;
+	int ret = -EINVAL;
+
+	if (ACCESS_ONCE(dev_data->dead))
+		return -ENODEV;
+
+	if (off == NS9XXX_I2C_OFF_SAMPLES) {
+		mutex_lock(&dev_data->ioctl_lock);
+		if (dev_data->sampler.owner == file)
+			ret = ns9xxx_ring_mmap(&dev_data->sampler.ring, vma);
+		mutex_unlock(&dev_data->ioctl_lock);
+		return ret;
+	}
+
+	if (off == NS9XXX_I2C_OFF_SLAVE) {
+		mutex_lock(&dev_data->slave_lock);
+		if (dev_data->mbox_owner == file)
+			ret = ns9xxx_ring_mmap(&dev_data->mbox_ring, vma);
+		mutex_unlock(&dev_data->slave_lock);
+		return ret;
+	}
+
+	mutex_lock(&priv->lock);
+
+	switch (off) {
+	case NS9XXX_I2C_OFF_SQ_RING:
+		if (priv->queue)
+			ret = ns9xxx_ring_mmap(&priv->queue->sq, vma);
+		break;
+	case NS9XXX_I2C_OFF_CQ_RING:
+		if (priv->queue)
+			ret = ns9xxx_ring_mmap(&priv->queue->cq, vma);
+		break;
+	case NS9XXX_I2C_OFF_DATA:
+		if (priv->queue && vma->vm_end - vma->vm_start ==
+				priv->queue->data_mapsize)
+			ret = remap_vmalloc_range(vma, priv->queue->data, 0);
+		break;
+	}
+
+	mutex_unlock(&priv->lock);
+
+	return ret;
+}
+
+static const struct file_operations ns9xxx_i2c_dev_fops = {
+	.owner		= THIS_MODULE,
+	.llseek		= no_llseek,
+	.read		= ns9xxx_i2c_dev_read,
+	.poll		= ns9xxx_i2c_dev_poll,
+	.unlocked_ioctl	= ns9xxx_i2c_dev_ioctl,
+	.mmap		= ns9xxx_i2c_dev_mmap,
+	.open		= ns9xxx_i2c_dev_open,
+	.release	= ns9xxx_i2c_dev_release,
+};
+
+static int ns9xxx_i2c_dev_register(struct ns9xxx_i2c *dev_data,
+		struct device *parent)
+{
+	int ret;
+
+	snprintf(dev_data->miscname, sizeof(dev_data->miscname),
+			DRIVER_NAME "-%d", dev_data->adap.nr);
+	dev_data->miscdev.minor = MISC_DYNAMIC_MINOR;
+	dev_data->miscdev.name = dev_data->miscname;
+	dev_data->miscdev.fops = &ns9xxx_i2c_dev_fops;
+	dev_data->miscdev.parent = parent;
+
+	ret = misc_register(&dev_data->miscdev);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ns9xxx_i2c_devices_lock);
+	list_add_tail(&dev_data->node, &ns9xxx_i2c_devices);
+	mutex_unlock(&ns9xxx_i2c_devices_lock);
+
+	return 0;
+}
+
+static void ns9xxx_i2c_dev_unregister(struct ns9xxx_i2c *dev_data)
+{
+	mutex_lock(&ns9xxx_i2c_devices_lock);
+	list_del(&dev_data->node);
+	mutex_unlock(&ns9xxx_i2c_devices_lock);
+
+	misc_deregister(&dev_data->miscdev);
+}
+
+
+/* sysfs */
+
+static const char *ns9xxx_qos_names[NS9XXX_QOS_CLASSES] = {
+	[NS9XXX_QOS_URGENT]	= "urgent",
+	[NS9XXX_QOS_NORMAL]	= "normal",
+	[NS9XXX_QOS_BULK]	= "bulk",
+};
+
+/* addresses not in the normal class, one "address class" per line */
+static ssize_t ns9xxx_i2c_qos_class_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int addr;
+
+	for (addr = 0; addr < ARRAY_SIZE(dev_data->qos_addr); addr++) {
+		if (dev_data->qos_addr[addr] == NS9XXX_QOS_NORMAL)
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len, "0x%02x %s\n",
+				addr, ns9xxx_qos_names[dev_data->qos_addr[addr]]);
+	}
+
+	return len;
+}
+
+static ssize_t ns9xxx_i2c_qos_class_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	char name[16];
+	int addr, qos;
+
+	if (sscanf(buf, "%i %15s", &addr, name) != 2 ||
+			addr < 0 || addr >= ARRAY_SIZE(dev_data->qos_addr))
+		return -EINVAL;
+
+	for (qos = 0; qos < NS9XXX_QOS_CLASSES; qos++)
+		if (!strcmp(name, ns9xxx_qos_names[qos]))
+			break;
+	if (qos == NS9XXX_QOS_CLASSES)
+		return -EINVAL;
+
+	dev_data->qos_addr[addr] = qos;
+
+	return count;
+}
+
+/* per class: transactions started, total and longest queueing delay (ns) */
+static ssize_t ns9xxx_i2c_qos_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	struct ns9xxx_qos_stats stats[NS9XXX_QOS_CLASSES];
+	unsigned long flags;
+	ssize_t len = 0;
+	int i;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	memcpy(stats, dev_data->qos_stats, sizeof(stats));
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	for (i = 0; i < NS9XXX_QOS_CLASSES; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"%s %lu %llu %llu %lu\n", ns9xxx_qos_names[i],
+				stats[i].count,
+				(unsigned long long)stats[i].total_ns,
+				(unsigned long long)stats[i].max_ns,
+				stats[i].splits);
+
+	return len;
+}
+
+/*
+ * Read cache rules, one "address register length ttl_ms hits misses" per
+ * line; write "address register length ttl_ms" to set a rule, with a ttl_ms
+ * of 0 to remove it.
+ */
+static ssize_t ns9xxx_i2c_read_cache_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	struct ns9xxx_cache_entry *e;
+	unsigned long flags;
+	ssize_t len = 0;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+	for (e = dev_data->cache; e < dev_data->cache + NS9XXX_CACHE_ENTRIES;
+			e++) {
+		if (!e->ttl_ns)
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"0x%02x 0x%02x %u %u %lu %lu\n",
+				e->addr, e->reg, e->len,
+				(unsigned int)div_u64(e->ttl_ns, NSEC_PER_MSEC),
+				e->hits, e->misses);
+	}
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	return len;
+}
+
+static ssize_t ns9xxx_i2c_read_cache_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	struct ns9xxx_cache_entry *e, *free = NULL;
+	unsigned int addr, reg, len, ttl_ms;
+	unsigned long flags;
+	int ret = count;
+
+	if (sscanf(buf, "%i %i %u %u", &addr, &reg, &len, &ttl_ms) != 4 ||
+			addr > 0x7f || reg > 0xff || !len ||
+			len > NS9XXX_CACHE_MAX_LEN)
+		return -EINVAL;
+
+	spin_lock_irqsave(&dev_data->lock, flags);
+
+	for (e = dev_data->cache; e < dev_data->cache + NS9XXX_CACHE_ENTRIES;
+			e++) {
+		if (!e->ttl_ns) {
+			if (!free)
+				free = e;
+			continue;
+		}
+		if (e->addr == addr && e->reg == reg && e->len == len)
+			break;
+	}
+
+	if (e == dev_data->cache + NS9XXX_CACHE_ENTRIES) {
+		if (!ttl_ms)
+			goto out;
+		if (!free) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		e = free;
+		dev_data->cache_rules++;
+	} else if (!ttl_ms)
+		dev_data->cache_rules--;
+
+	e->addr = addr;
+	e->reg = reg;
+	e->len = len;
+	e->ttl_ns = (u64)ttl_ms * NSEC_PER_MSEC;
+	e->id++;
+	e->valid = 0;
+	e->hits = e->misses = 0;
+
+out:
+	spin_unlock_irqrestore(&dev_data->lock, flags);
+
+	return ret;
+}
+
+/*
+ * Enabled addresses, one "address mode" per line; write "address mode"
+ * with a mode of 0 (off), 1 (on) or 2 (on, coalescing adjacent registers).
+ */
+static ssize_t ns9xxx_i2c_write_behind_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int addr;
+
+	for (addr = 0; addr < ARRAY_SIZE(dev_data->wb_addr); addr++)
+		if (dev_data->wb_addr[addr])
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					"0x%02x %d\n", addr,
+					dev_data->wb_addr[addr]);
+
+	return len;
+}
+
+static ssize_t ns9xxx_i2c_write_behind_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	int addr, mode;
 
-			if (msgs[i].flags & I2C_M_RD)
-				ret = ns9xxx_i2c_read(dev_data, len);
-			else
-				ret = ns9xxx_i2c_write(dev_data, buf, len);
-			if (ret) {
-				if (dev_data->state == I2C_INT_RETRY) {
-					i = 0;
-					continue;
-				}
-				break;
+	if (sscanf(buf, "%i %i", &addr, &mode) != 2 ||
+			addr < 0 || addr >= ARRAY_SIZE(dev_data->wb_addr) ||
+			mode < 0 || mode > NS9XXX_WB_COALESCE)
+		return -EINVAL;
+
+	dev_data->wb_addr[addr] = mode;
+	if (!mode)
+		ns9xxx_wb_flush(dev_data);
+
+	return count;
+}
+
+/*
+ * Writes queued, merged into a pending one, flushes, failed writes, writes
+ * coalesced and the bus time (ns) that saved
+ */
+static ssize_t ns9xxx_i2c_write_behind_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	struct ns9xxx_wb_stats stats;
+
+	mutex_lock(&dev_data->wb_lock);
+	stats = dev_data->wb_stats;
+	mutex_unlock(&dev_data->wb_lock);
+
+	return sprintf(buf, "%lu %lu %lu %lu %lu %llu\n", stats.queued,
+			stats.merged, stats.flushes, stats.failed,
+			stats.coalesced, (unsigned long long)stats.saved_ns);
+}
+
+/* slave backend and address, "none" if not attached; write the same */
+static ssize_t ns9xxx_i2c_slave_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	ssize_t len;
+
+	mutex_lock(&dev_data->slave_lock);
+	if (dev_data->slave)
+		len = sprintf(buf, "%s 0x%02x\n", dev_data->slave->name,
+				dev_data->slave_addr);
+	else
+		len = sprintf(buf, "none\n");
+	mutex_unlock(&dev_data->slave_lock);
+
+	return len;
+}
+
+static ssize_t ns9xxx_i2c_slave_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	char name[16];
+	int i, n, addr, ret = 0;
+
+	n = sscanf(buf, "%15s %i", name, &addr);
+	if (!(n == 1 && !strcmp(name, "none")) &&
+			!(n == 2 && addr >= 0 && addr <= 0x7f))
+		return -EINVAL;
+
+	mutex_lock(&dev_data->slave_lock);
+	if (n == 1)
+		ns9xxx_slave_detach(dev_data);
+	else {
+		ret = -EINVAL;
+		for (i = 0; i < ARRAY_SIZE(ns9xxx_slave_backends); i++)
+			if (!strcmp(name, ns9xxx_slave_backends[i]->name))
+				ret = ns9xxx_slave_attach(dev_data,
+						ns9xxx_slave_backends[i], addr);
+	}
+	mutex_unlock(&dev_data->slave_lock);
+
+	return ret ? ret : count;
+}
+
+static const char * const ns9xxx_stat_names[] = {
+	"xfers", "read_bytes", "write_bytes", "nacks", "arbitration_lost",
+	"timeouts", "busy_waits", "reinits", "bitbang_resets", "busy_ns",
+};
+
+/* adapter counters, summed over the CPUs, one "name value" per line */
+static ssize_t ns9xxx_i2c_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	u64 sum[ARRAY_SIZE(ns9xxx_stat_names)] = { 0 };
+	const u64 *v;
+	ssize_t len = 0;
+	int cpu, i;
+
+	BUILD_BUG_ON(sizeof(struct ns9xxx_stats) != sizeof(sum));
+
+	for_each_possible_cpu(cpu) {
+		v = (const u64 *)per_cpu_ptr(dev_data->stats, cpu);
+		for (i = 0; i < ARRAY_SIZE(sum); i++)
+			sum[i] += v[i];
+	}
+
+	for (i = 0; i < ARRAY_SIZE(sum); i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu\n",
+				ns9xxx_stat_names[i],
+				(unsigned long long)sum[i]);
+
+	return len;
+}
+
+/*
+ * Any write clears the counters; an update racing with it on another CPU
+ * may survive.
+ */
+static ssize_t ns9xxx_i2c_stats_reset_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct ns9xxx_i2c *dev_data = dev_get_drvdata(dev);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dev_data->stats, cpu), 0,
+				sizeof(struct ns9xxx_stats));
+
+	return count;
+}
+
+static DEVICE_ATTR(qos_class, S_IRUGO | S_IWUSR, ns9xxx_i2c_qos_class_show,
+		ns9xxx_i2c_qos_class_store);
+static DEVICE_ATTR(qos_stats, S_IRUGO, ns9xxx_i2c_qos_stats_show, NULL);
+static DEVICE_ATTR(read_cache, S_IRUGO | S_IWUSR, ns9xxx_i2c_read_cache_show,
+		ns9xxx_i2c_read_cache_store);
+static DEVICE_ATTR(write_behind, S_IRUGO | S_IWUSR,
+		ns9xxx_i2c_write_behind_show, ns9xxx_i2c_write_behind_store);
+static DEVICE_ATTR(write_behind_stats, S_IRUGO,
+		ns9xxx_i2c_write_behind_stats_show, NULL);
+static DEVICE_ATTR(slave, S_IRUGO | S_IWUSR, ns9xxx_i2c_slave_show,
+		ns9xxx_i2c_slave_store);
+static DEVICE_ATTR(stats, S_IRUGO, ns9xxx_i2c_stats_show, NULL);
+static DEVICE_ATTR(stats_reset, S_IWUSR, NULL, ns9xxx_i2c_stats_reset_store);
+
+static struct attribute *ns9xxx_i2c_attrs[] = {
+	&dev_attr_qos_class.attr,
+	&dev_attr_qos_stats.attr,
+	&dev_attr_read_cache.attr,
+	&dev_attr_write_behind.attr,
+	&dev_attr_write_behind_stats.attr,
+	&dev_attr_slave.attr,
+	&dev_attr_stats.attr,
+	&dev_attr_stats_reset.attr,
+	NULL
+};
+
+static const struct attribute_group ns9xxx_i2c_attr_group = {
+	.attrs	= ns9xxx_i2c_attrs,
+};
+
+
+/*
+ * debugfs
+ *
+ * <debugfs>/i2c-ns9xxx/hist_enabled switches histogram collection for all
+ * adapters; each adapter has its own directory, named after it.
+ */
+
+static const char * const ns9xxx_hist_names[NS9XXX_HIST_TYPES] = {
+	[NS9XXX_HIST_XFER]	= "xfer",
+	[NS9XXX_HIST_CMD]	= "cmd",
+	[NS9XXX_HIST_WAKEUP]	= "wakeup",
+	[NS9XXX_HIST_RECOVERY]	= "recovery",
+};
+
+/* per type, "lower bound in ns, count" for every bucket that is not empty */
+static int ns9xxx_hist_show(struct seq_file *m, void *v)
+{
+	struct ns9xxx_i2c *dev_data = m->private;
+	struct ns9xxx_hist *h;
+	unsigned long count;
+	int cpu, t, b;
+
+	for (t = 0; t < NS9XXX_HIST_TYPES; t++) {
+		seq_printf(m, "%s\n", ns9xxx_hist_names[t]);
+		for (b = 0; b < NS9XXX_HIST_BUCKETS; b++) {
+			count = 0;
+			for_each_possible_cpu(cpu) {
+				h = per_cpu_ptr(dev_data->hist, cpu);
+				count += h->count[t][b];
 			}
+			if (count)
+				seq_printf(m, "%12llu %lu\n",
+						b ? 1ULL << (b - 1) : 0ULL,
+						count);
 		}
 	}
 
-	if (ns9xxx_i2c_send_cmd(dev_data, I2C_CMD_STOP)) {
-		printk(KERN_WARNING "NS9XXX I2C: interface seems to be stuck, trying to unlock (state %lx)\n", (unsigned long)dev_data->state);
-		/* sometimes interface gets stucked
-		 * try to fix this by send "start, nop, start" */
-		ns9xxx_i2c_send_cmd(dev_data, I2C_CMD_NOP);
-		if (ns9xxx_i2c_send_cmd(dev_data, I2C_CMD_STOP)) {
-			printk(KERN_WARNING "NS9XXX I2C: interface still stuck, forcing bus-reset using GPIO\n");
-			ns9xxx_i2c_reset_bitbang(dev_data);
-		}
+	return 0;
+}
+
+static int ns9xxx_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ns9xxx_hist_show, inode->i_private);
+}
+
+/* any write clears the histograms */
+static ssize_t ns9xxx_hist_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct ns9xxx_i2c *dev_data =
+		((struct seq_file *)file->private_data)->private;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dev_data->hist, cpu), 0,
+				sizeof(struct ns9xxx_hist));
+
+	return count;
+}
+
+static const struct file_operations ns9xxx_hist_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ns9xxx_hist_open,
+	.read		= seq_read,
+	.write		= ns9xxx_hist_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void ns9xxx_fr_show_entries(struct seq_file *m,
+		const struct ns9xxx_fr *fr)
+{
+	unsigned int i, n = min_t(unsigned int, fr->head, NS9XXX_FR_ENTRIES);
+	char line[80];
+
+	for (i = fr->head - n; i != fr->head; i++) {
+		ns9xxx_fr_entry_str(&fr->e[i & (NS9XXX_FR_ENTRIES - 1)],
+				line, sizeof(line));
+		seq_printf(m, "%s\n", line);
 	}
-	
+}
+
+/* the snapshot of the last timeout or recovery, then the live recorder */
+static int ns9xxx_fr_show(struct seq_file *m, void *v)
+{
+	struct ns9xxx_i2c *dev_data = m->private;
+	struct ns9xxx_fr *fr;
+	const char *reason;
+	unsigned long flags;
+	u64 ts;
+	u32 status;
+
+	fr = kmalloc(2 * sizeof(*fr), GFP_KERNEL);
+	if (!fr)
+		return -ENOMEM;
+
 	spin_lock_irqsave(&dev_data->lock, flags);
-	dev_data->buf = NULL;
+	fr[0] = dev_data->fr_snap;
+	fr[1] = dev_data->fr;
+	reason = dev_data->fr_snap_reason;
+	ts = dev_data->fr_snap_ts;
+	status = dev_data->fr_snap_status;
 	spin_unlock_irqrestore(&dev_data->lock, flags);
 
-	/* return ERROR or number of transmits */
-	return ((ret < 0) ? ret : i);
+	if (reason) {
+		seq_printf(m, "last: %s at %llu ns, STATUS 0x%08x\n", reason,
+				(unsigned long long)ts, status);
+		ns9xxx_fr_show_entries(m, &fr[0]);
+	} else
+		seq_puts(m, "last: none\n");
+
+	seq_puts(m, "now:\n");
+	ns9xxx_fr_show_entries(m, &fr[1]);
+
+	kfree(fr);
+
+	return 0;
+}
+
+static int ns9xxx_fr_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ns9xxx_fr_show, inode->i_private);
+}
+
+static const struct file_operations ns9xxx_fr_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ns9xxx_fr_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Capture
+ *
+ * Reading i2c-ns9xxx/i2c-N/capture in debugfs starts a capture that lasts
+ * until the file is closed. It returns a pcap stream with the Linux I2C
+ * link type (DLT_I2C_LINUX), as understood by Wireshark: every message of
+ * a successful transaction is one packet, stamped with the start of the
+ * transaction, made of the bus number, the message flags (32 bit, big
+ * endian), the address byte and the data. The link type has no room for a
+ * 10-bit address, so I2C_M_TEN messages are left out and counted as
+ * dropped.
+ *
+ * i2c-ns9xxx/i2c-N/record works the same way, but returns one struct
+ * ns9xxx_i2c_record per call, failed ones included, for replaying the
+ * workload with tools/i2c-ns9xxx/i2c-ns9xxx-replay; see
+ * include/linux/i2c-ns9xxx-dev.h. Only one of the two can be open.
+ *
+ * Messages or records that do not fit in the ring while the reader is
+ * behind are dropped. An open capture holds a reference on the adapter
+ * data, and reads return end of file once the adapter is removed.
+ */
+#define NS9XXX_PCAP_MAGIC_NS		0xa1b23c4d
+#define NS9XXX_DLT_I2C_LINUX		209
+
+struct ns9xxx_pcap_hdr {
+	u32	magic;
+	u16	version_major;
+	u16	version_minor;
+	s32	thiszone;
+	u32	sigfigs;
+	u32	snaplen;
+	u32	network;
+};
+
+struct ns9xxx_pcap_rec {
+	u32	ts_sec;
+	u32	ts_nsec;
+	u32	incl_len;
+	u32	orig_len;
+	u8	bus;
+	__be32	flags;
+	u8	addr;
+} __attribute__((packed));
+
+/* copy to the ring at head + off, not yet visible to the reader */
+static void ns9xxx_cap_put(struct ns9xxx_cap *cap, u32 off, const void *data,
+		u32 len)
+{
+	u32 pos = (cap->head + off) & (NS9XXX_CAP_SIZE - 1);
+	u32 n = min_t(u32, len, NS9XXX_CAP_SIZE - pos);
+
+	memcpy(cap->buf + pos, data, n);
+	memcpy(cap->buf, data + n, len - n);
+}
+
+static void ns9xxx_cap_pcap(struct ns9xxx_i2c *dev_data, ktime_t ts,
+		const struct i2c_msg *msgs, int num)
+{
+	struct ns9xxx_cap *cap = dev_data->cap;
+	struct timespec tv = ktime_to_timespec(ts);
+	struct ns9xxx_pcap_rec rec;
+	u32 used, len;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (msgs[i].flags & I2C_M_TEN) {
+			cap->dropped++;
+			continue;
+		}
+
+		len = sizeof(rec) + msgs[i].len;
+		used = cap->head - ACCESS_ONCE(cap->tail);
+		if (len > NS9XXX_CAP_SIZE - used) {
+			cap->dropped++;
+			continue;
+		}
+
+		rec.ts_sec = tv.tv_sec;
+		rec.ts_nsec = tv.tv_nsec;
+		rec.incl_len = len - 16;
+		rec.orig_len = len - 16;
+		rec.bus = dev_data->adap.nr;
+		rec.flags = cpu_to_be32(msgs[i].flags);
+		rec.addr = (msgs[i].addr << 1) |
+			((msgs[i].flags & I2C_M_RD) ? 1 : 0);
+
+		ns9xxx_cap_put(cap, 0, &rec, sizeof(rec));
+		ns9xxx_cap_put(cap, sizeof(rec), msgs[i].buf, msgs[i].len);
+		smp_wmb();
+		cap->head += len;
+	}
+}
+
+static void ns9xxx_cap_record(struct ns9xxx_i2c *dev_data, ktime_t start,
+		const struct i2c_msg *msgs, int num, int ret)
+{
+	struct ns9xxx_cap *cap = dev_data->cap;
+	struct ns9xxx_i2c_record rec;
+	struct ns9xxx_i2c_record_msg m;
+	u32 len, off;
+	s64 ns;
+	int i;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	rec.start_ns = ktime_to_ns(start);
+	rec.duration_ns = min_t(s64, ns, U32_MAX);
+	rec.result = ret;
+	rec.nmsgs = num;
+	rec.reserved = 0;
+	rec.data_len = 0;
+	for (i = 0; i < num; i++)
+		if (!(msgs[i].flags & I2C_M_RD))
+			rec.data_len += msgs[i].len;
+
+	len = sizeof(rec) + num * sizeof(m) + rec.data_len;
+	if (len > NS9XXX_CAP_SIZE - (cap->head - ACCESS_ONCE(cap->tail))) {
+		cap->dropped++;
+		return;
+	}
+
+	ns9xxx_cap_put(cap, 0, &rec, sizeof(rec));
+	off = sizeof(rec);
+	for (i = 0; i < num; i++) {
+		m.addr = msgs[i].addr;
+		m.flags = msgs[i].flags;
+		m.len = msgs[i].len;
+		m.reserved = 0;
+		ns9xxx_cap_put(cap, off, &m, sizeof(m));
+		off += sizeof(m);
+	}
+	for (i = 0; i < num; i++) {
+		if (msgs[i].flags & I2C_M_RD)
+			continue;
+		ns9xxx_cap_put(cap, off, msgs[i].buf, msgs[i].len);
+		off += msgs[i].len;
+	}
+
+	smp_wmb();
+	cap->head += len;
+}
+
+static void ns9xxx_cap_xfer(struct ns9xxx_i2c *dev_data, ktime_t ts,
+		const struct i2c_msg *msgs, int num, int ret)
+{
+	struct ns9xxx_cap *cap = dev_data->cap;
+
+	if (cap->format == NS9XXX_CAP_RECORD)
+		ns9xxx_cap_record(dev_data, ts, msgs, num, ret);
+	else if (ret > 0)
+		ns9xxx_cap_pcap(dev_data, ts, msgs, ret);
+
+	/* order the head store before the check, against the reader's wait */
+	smp_mb();
+	if (waitqueue_active(&cap->wait))
+		wake_up_interruptible(&cap->wait);
+}
+
+static int ns9xxx_cap_start(struct ns9xxx_i2c *dev_data, struct file *file,
+		enum ns9xxx_cap_format format, const void *hdr, u32 hdr_len)
+{
+	struct ns9xxx_cap *cap;
+	int ret = 0;
+
+	cap = kzalloc(sizeof(*cap), GFP_KERNEL);
+	if (!cap)
+		return -ENOMEM;
+
+	cap->buf = vmalloc(NS9XXX_CAP_SIZE);
+	if (!cap->buf) {
+		kfree(cap);
+		return -ENOMEM;
+	}
+	init_waitqueue_head(&cap->wait);
+	cap->format = format;
+
+	ns9xxx_cap_put(cap, 0, hdr, hdr_len);
+	cap->head = hdr_len;
+
+	i2c_lock_adapter(&dev_data->adap);
+	if (dev_data->cap)
+		ret = -EBUSY;
+	else
+		dev_data->cap = cap;
+	i2c_unlock_adapter(&dev_data->adap);
+
+	if (ret) {
+		vfree(cap->buf);
+		kfree(cap);
+		return ret;
+	}
+
+	ns9xxx_i2c_get(dev_data);
+	file->private_data = dev_data;
+
+	return 0;
+}
+
+static int ns9xxx_cap_open(struct inode *inode, struct file *file)
+{
+	struct ns9xxx_pcap_hdr hdr = {
+		.magic		= NS9XXX_PCAP_MAGIC_NS,
+		.version_major	= 2,
+		.version_minor	= 4,
+		.snaplen	= 65535,
+		.network	= NS9XXX_DLT_I2C_LINUX,
+	};
+	int ret;
+
+	ret = ns9xxx_cap_start(inode->i_private, file, NS9XXX_CAP_PCAP,
+			&hdr, sizeof(hdr));
+
+	return ret ? ret : nonseekable_open(inode, file);
+}
+
+static int ns9xxx_record_open(struct inode *inode, struct file *file)
+{
+	struct ns9xxx_i2c *dev_data = inode->i_private;
+	struct ns9xxx_i2c_record_hdr hdr = {
+		.magic		= NS9XXX_I2C_RECORD_MAGIC,
+		.version	= NS9XXX_I2C_RECORD_VERSION,
+		.bus		= dev_data->adap.nr,
+		.bus_freq	= dev_data->bus_freq,
+	};
+	int ret;
+
+	ret = ns9xxx_cap_start(dev_data, file, NS9XXX_CAP_RECORD,
+			&hdr, sizeof(hdr));
+
+	return ret ? ret : nonseekable_open(inode, file);
+}
+
+static int ns9xxx_cap_release(struct inode *inode, struct file *file)
+{
+	struct ns9xxx_i2c *dev_data = file->private_data;
+	struct ns9xxx_cap *cap;
+
+	i2c_lock_adapter(&dev_data->adap);
+	cap = dev_data->cap;
+	dev_data->cap = NULL;
+	i2c_unlock_adapter(&dev_data->adap);
+
+	if (cap->dropped)
+		dev_info(dev_data->dev, "capture: %u %s dropped\n",
+				cap->dropped, cap->format == NS9XXX_CAP_PCAP ?
+				"messages" : "records");
+
+	vfree(cap->buf);
+	kfree(cap);
+	ns9xxx_i2c_put(dev_data);
+
+	return 0;
+}
+
+static ssize_t ns9xxx_cap_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct ns9xxx_i2c *dev_data = file->private_data;
+	struct ns9xxx_cap *cap = dev_data->cap;
+	u32 head, pos, n, chunk;
+	int ret;
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (ACCESS_ONCE(cap->head) == cap->tail &&
+				!ACCESS_ONCE(dev_data->dead))
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(cap->wait,
+				ACCESS_ONCE(cap->head) != cap->tail ||
+				ACCESS_ONCE(dev_data->dead));
+		if (ret)
+			return ret;
+	}
+
+	head = ACCESS_ONCE(cap->head);
+	smp_rmb();
+	if (head == cap->tail)
+		return 0;
+
+	n = min_t(u32, count, head - cap->tail);
+	pos = cap->tail & (NS9XXX_CAP_SIZE - 1);
+	chunk = min_t(u32, n, NS9XXX_CAP_SIZE - pos);
+	if (copy_to_user(buf, cap->buf + pos, chunk) ||
+			copy_to_user(buf + chunk, cap->buf, n - chunk))
+		return -EFAULT;
+
+	smp_mb();
+	cap->tail += n;
+
+	return n;
+}
+
+static const struct file_operations ns9xxx_cap_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ns9xxx_cap_open,
+	.read		= ns9xxx_cap_read,
+	.llseek		= no_llseek,
+	.release	= ns9xxx_cap_release,
+};
+
+static const struct file_operations ns9xxx_record_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ns9xxx_record_open,
+	.read		= ns9xxx_cap_read,
+	.llseek		= no_llseek,
+	.release	= ns9xxx_cap_release,
+};
+
+/* debugfs is optional, failures are ignored */
+static void ns9xxx_i2c_debugfs_init(struct ns9xxx_i2c *dev_data)
+{
+	if (!ns9xxx_debugfs)
+		return;
+
+	dev_data->debugfs = debugfs_create_dir(dev_name(&dev_data->adap.dev),
+			ns9xxx_debugfs);
+	if (!dev_data->debugfs)
+		return;
+
+	debugfs_create_file("histograms", S_IRUGO | S_IWUSR, dev_data->debugfs,
+			dev_data, &ns9xxx_hist_fops);
+	debugfs_create_file("flight_recorder", S_IRUGO, dev_data->debugfs,
+			dev_data, &ns9xxx_fr_fops);
+	debugfs_create_file("capture", S_IRUSR, dev_data->debugfs,
+			dev_data, &ns9xxx_cap_fops);
+	debugfs_create_file("record", S_IRUSR, dev_data->debugfs,
+			dev_data, &ns9xxx_record_fops);
+}
+
+static void ns9xxx_i2c_debugfs_remove(struct ns9xxx_i2c *dev_data)
+{
+	debugfs_remove_recursive(dev_data->debugfs);
 }
 
+
 static int ns9xxx_i2c_set_clock(struct ns9xxx_i2c *dev_data, unsigned int freq)
 {
 	u32 config;
@@ -634,17 +5056,70 @@ static int ns9xxx_i2c_set_clock(struct ns9xxx_i2c *dev_data, unsigned int freq)
 	}
 
 	writel(config, dev_data->ioaddr + I2C_CONFIG);
+	dev_data->bus_freq = freq;
 	
-	printk(KERN_INFO "NS9XXX I2C: bus frequency set to %u, CPU clock = %lu, scl_delay = %u, config -> 0x%lx\n", freq, (unsigned long)(clk_get_rate(dev_data->clk)), (unsigned int)scl_delay, (unsigned long)config);
+	trace_i2c_ns9xxx_clock(dev_data->adap.nr, freq,
+			clk_get_rate(dev_data->clk), config);
+
+	return 0;
+}
+
+/*
+ * SMBALERT#: i2c-smbus reads the Alert Response Address when the line is
+ * pulled low and calls ->alert() of the client driver that answered. A
+ * built-in driver cannot link against i2c-smbus built as a module.
+ */
+#if defined(CONFIG_I2C_SMBUS) || \
+		(defined(CONFIG_I2C_SMBUS_MODULE) && defined(MODULE))
+#define NS9XXX_SMBUS_ALERT
+#endif
+
+static int ns9xxx_i2c_alert_setup(struct ns9xxx_i2c *dev_data)
+{
+#ifdef NS9XXX_SMBUS_ALERT
+	struct i2c_smbus_alert_setup setup;
+	unsigned int gpio = dev_data->pdata->gpio_alert;
+	int ret;
+
+	if (!gpio)
+		return 0;
 
+	ret = gpio_request(gpio, DRIVER_NAME);
+	if (ret)
+		return ret;
+	gpio_direction_input(gpio);
+
+	setup.alert_edge_triggered = 0;
+	setup.irq = gpio_to_irq(gpio);
+	set_irq_type(setup.irq, IRQ_TYPE_LEVEL_LOW);
+
+	dev_data->ara = i2c_setup_smbus_alert(&dev_data->adap, &setup);
+	if (!dev_data->ara) {
+		gpio_free(gpio);
+		return -ENODEV;
+	}
+#else
+	if (dev_data->pdata->gpio_alert)
+		dev_warn(dev_data->dev, "SMBALERT# on GPIO %u ignored, i2c-smbus not available to this driver\n",
+				dev_data->pdata->gpio_alert);
+#endif
 
 	return 0;
 }
 
+static void ns9xxx_i2c_alert_remove(struct ns9xxx_i2c *dev_data)
+{
+	if (!dev_data->ara)
+		return;
+
+	i2c_unregister_device(dev_data->ara);
+	gpio_free(dev_data->pdata->gpio_alert);
+}
+
 static int __devinit ns9xxx_i2c_probe(struct platform_device *pdev)
 {
 	struct ns9xxx_i2c *dev_data;
-	int ret;
+	int i, ret;
 
 	dev_data = kzalloc(sizeof(*dev_data), GFP_KERNEL);
 	if (!dev_data) {
@@ -653,6 +5128,21 @@ static int __devinit ns9xxx_i2c_probe(struct platform_device *pdev)
 		goto err_alloc_dd;
 	}
 	platform_set_drvdata(pdev, dev_data);
+	dev_data->dev = &pdev->dev;
+
+	dev_data->stats = alloc_percpu(struct ns9xxx_stats);
+	if (!dev_data->stats) {
+		dev_dbg(&pdev->dev, "%s: err_alloc_stats\n", __func__);
+		ret = -ENOMEM;
+		goto err_alloc_stats;
+	}
+
+	dev_data->hist = alloc_percpu(struct ns9xxx_hist);
+	if (!dev_data->hist) {
+		dev_dbg(&pdev->dev, "%s: err_alloc_hist\n", __func__);
+		ret = -ENOMEM;
+		goto err_alloc_hist;
+	}
 
 	dev_data->pdata = pdev->dev.platform_data;
 	if (!dev_data->pdata) {
@@ -669,11 +5159,44 @@ static int __devinit ns9xxx_i2c_probe(struct platform_device *pdev)
 	dev_data->adap.retries = 1;
 	dev_data->adap.timeout = HZ / 10;
 	dev_data->adap.class = I2C_CLASS_HWMON;
-	dev_data->buf = NULL;
 
 	spin_lock_init(&dev_data->lock);
+	spin_lock_init(&dev_data->warn_lock);
+	dev_data->warn_begin = jiffies;
+	setup_timer(&dev_data->warn_timer, ns9xxx_warn_timer,
+			(unsigned long)dev_data);
 	init_waitqueue_head(&dev_data->wait_q);
 
+	for (i = 0; i < NS9XXX_QOS_CLASSES; i++)
+		INIT_LIST_HEAD(&dev_data->queue[i]);
+	memset(dev_data->qos_addr, NS9XXX_QOS_NORMAL,
+			sizeof(dev_data->qos_addr));
+	dev_data->phase = NS9XXX_PHASE_IDLE;
+	dev_data->masteraddr = ~0;
+	init_waitqueue_head(&dev_data->idle_q);
+	mutex_init(&dev_data->wb_lock);
+	mutex_init(&dev_data->wb_flush_lock);
+	INIT_DELAYED_WORK(&dev_data->wb_work, ns9xxx_wb_work);
+	setup_timer(&dev_data->watchdog, ns9xxx_engine_watchdog,
+			(unsigned long)dev_data);
+	INIT_WORK(&dev_data->recover_work, ns9xxx_engine_recover);
+	hrtimer_init(&dev_data->ackpoll_timer, CLOCK_MONOTONIC,
+			HRTIMER_MODE_REL);
+	dev_data->ackpoll_timer.function = ns9xxx_engine_ackpoll_timer;
+
+	mutex_init(&dev_data->ioctl_lock);
+	kref_init(&dev_data->ref);
+	init_waitqueue_head(&dev_data->sampler.wait);
+	hrtimer_init(&dev_data->sampler.timer, CLOCK_MONOTONIC,
+			HRTIMER_MODE_ABS);
+	dev_data->sampler.timer.function = ns9xxx_sampler_timer;
+
+	mutex_init(&dev_data->slave_lock);
+	hrtimer_init(&dev_data->slave_timer, CLOCK_MONOTONIC,
+			HRTIMER_MODE_REL);
+	dev_data->slave_timer.function = ns9xxx_slave_timer;
+	init_waitqueue_head(&dev_data->mbox_wait);
+
 	dev_data->irq = platform_get_irq(pdev, 0);
 	if (dev_data->irq <= 0) {
 		dev_dbg(&pdev->dev, "%s: err_irq\n", __func__);
@@ -773,12 +5296,40 @@ static int __devinit ns9xxx_i2c_probe(struct platform_device *pdev)
 		goto err_add_adap;
 	}
 
+	ret = ns9xxx_i2c_alert_setup(dev_data);
+	if (ret) {
+		dev_dbg(&pdev->dev, "%s: err_alert\n", __func__);
+		goto err_alert;
+	}
+
+	ret = sysfs_create_group(&pdev->dev.kobj, &ns9xxx_i2c_attr_group);
+	if (ret) {
+		dev_dbg(&pdev->dev, "%s: err_sysfs\n", __func__);
+		goto err_sysfs;
+	}
+
+	ret = ns9xxx_i2c_dev_register(dev_data, &pdev->dev);
+	if (ret) {
+		dev_dbg(&pdev->dev, "%s: err_dev_register\n", __func__);
+		goto err_dev_register;
+	}
+
+	ns9xxx_i2c_debugfs_init(dev_data);
+
 	dev_info(&pdev->dev, "NS9XXX I2C adapter\n");
 
 	return 0;
 
+err_dev_register:
+	sysfs_remove_group(&pdev->dev.kobj, &ns9xxx_i2c_attr_group);
+err_sysfs:
+	ns9xxx_i2c_alert_remove(dev_data);
+err_alert:
+	i2c_del_adapter(&dev_data->adap);
 err_add_adap:
 	free_irq(dev_data->irq, dev_data);
+	del_timer_sync(&dev_data->watchdog);
+	cancel_work_sync(&dev_data->recover_work);
 err_req_irq:
 err_set_clk:
 err_cfg_gpio:
@@ -797,20 +5348,31 @@ err_map_mem:
 err_req_mem:
 err_mem:
 err_irq:
+	del_timer_sync(&dev_data->warn_timer);
 err_pdata:
-err_alloc_dd:
+	free_percpu(dev_data->hist);
+err_alloc_hist:
+	free_percpu(dev_data->stats);
+err_alloc_stats:
 	kfree(dev_data);
+err_alloc_dd:
 
 	return ret;
 }
 
-static int __devexit ns9xxx_i2c_remove(struct platform_device *pdev)
+/* last reference gone: no adapter, no open file */
+static void ns9xxx_i2c_free(struct kref *ref)
 {
-	struct ns9xxx_i2c *dev_data = platform_get_drvdata(pdev);
+	struct ns9xxx_i2c *dev_data = container_of(ref, struct ns9xxx_i2c, ref);
 
-	i2c_del_adapter(&dev_data->adap);
+	ns9xxx_ring_free(&dev_data->mbox_ring);
+
+	hrtimer_cancel(&dev_data->ackpoll_timer);
+	del_timer_sync(&dev_data->watchdog);
+	cancel_work_sync(&dev_data->recover_work);
 
 	free_irq(dev_data->irq, dev_data);
+	del_timer_sync(&dev_data->warn_timer);
 
 	clk_disable(dev_data->clk);
 	clk_put(dev_data->clk);
@@ -822,7 +5384,37 @@ static int __devexit ns9xxx_i2c_remove(struct platform_device *pdev)
 	release_mem_region(dev_data->mem->start,
 			dev_data->mem->end - dev_data->mem->start + 1);
 
+	free_percpu(dev_data->hist);
+	free_percpu(dev_data->stats);
 	kfree(dev_data);
+}
+
+static int __devexit ns9xxx_i2c_remove(struct platform_device *pdev)
+{
+	struct ns9xxx_i2c *dev_data = platform_get_drvdata(pdev);
+
+	ns9xxx_i2c_debugfs_remove(dev_data);
+	ns9xxx_i2c_dev_unregister(dev_data);
+	sysfs_remove_group(&pdev->dev.kobj, &ns9xxx_i2c_attr_group);
+	mutex_lock(&dev_data->slave_lock);
+	ns9xxx_slave_detach(dev_data);
+	mutex_unlock(&dev_data->slave_lock);
+	ns9xxx_i2c_alert_remove(dev_data);
+	i2c_del_adapter(&dev_data->adap);
+	/* no client can queue writes behind or arm wb_work any more */
+	cancel_delayed_work_sync(&dev_data->wb_work);
+	ns9xxx_wb_flush(dev_data);
+
+	/* wake up readers and pollers of files that are still open */
+	dev_data->dead = 1;
+	wake_up_all(&dev_data->sampler.wait);
+	wake_up_all(&dev_data->mbox_wait);
+	i2c_lock_adapter(&dev_data->adap);
+	if (dev_data->cap)
+		wake_up_all(&dev_data->cap->wait);
+	i2c_unlock_adapter(&dev_data->adap);
+
+	kref_put(&dev_data->ref, ns9xxx_i2c_free);
 
 	return 0;
 }
@@ -838,12 +5430,24 @@ static struct platform_driver ns9xxx_i2c_driver = {
 
 static int __init ns9xxx_i2c_init(void)
 {
-	return platform_driver_register(&ns9xxx_i2c_driver);
+	int ret;
+
+	ns9xxx_debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+	if (ns9xxx_debugfs)
+		debugfs_create_bool("hist_enabled", S_IRUGO | S_IWUSR,
+				ns9xxx_debugfs, &ns9xxx_hist_enabled);
+
+	ret = platform_driver_register(&ns9xxx_i2c_driver);
+	if (ret)
+		debugfs_remove_recursive(ns9xxx_debugfs);
+
+	return ret;
 }
 
 static void __exit ns9xxx_i2c_exit(void)
 {
 	platform_driver_unregister(&ns9xxx_i2c_driver);
+	debugfs_remove_recursive(ns9xxx_debugfs);
 }
 
 module_init(ns9xxx_i2c_init);
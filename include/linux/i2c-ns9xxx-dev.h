@@ -0,0 +1,334 @@
+/*
+ * include/linux/i2c-ns9xxx-dev.h
+ *
+ * Userspace interface of the /dev/i2c-ns9xxx-N character devices
+ * created by drivers/i2c/busses/i2c-ns9xxx.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#ifndef __LINUX_I2C_NS9XXX_DEV_H
+#define __LINUX_I2C_NS9XXX_DEV_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Header at the start of every mmap()ed ring. The producer only writes
+ * head, the consumer only writes tail; both count entries and wrap
+ * modulo 2^32, the entry for index i is at offset + (i & (entries - 1)) *
+ * entry_size from the start of the mapping.
+ */
+struct ns9xxx_i2c_ring {
+	__u32	head;
+	__u32	tail;
+	__u32	entries;	/* power of two */
+	__u32	entry_size;
+	__u32	offset;
+	__u32	dropped;	/* entries lost because the ring was full */
+};
+
+/* mmap() offsets of the rings */
+#define NS9XXX_I2C_OFF_SAMPLES		0x00000000ULL
+#define NS9XXX_I2C_OFF_SQ_RING		0x10000000ULL
+#define NS9XXX_I2C_OFF_CQ_RING		0x20000000ULL
+#define NS9XXX_I2C_OFF_DATA		0x30000000ULL
+#define NS9XXX_I2C_OFF_SLAVE		0x40000000ULL
+
+/*
+ * Periodic sampler: each entry reads len bytes from register reg of the
+ * 7-bit address addr every period_us microseconds.
+ */
+#define NS9XXX_I2C_SAMPLE_MAX		32
+#define NS9XXX_I2C_SAMPLER_MAX_ENTRIES	64
+
+struct ns9xxx_i2c_sample_entry {
+	__u16	addr;
+	__u8	reg;
+	__u8	len;
+	__u32	period_us;
+};
+
+struct ns9xxx_i2c_sampler {
+	__u32	num;		/* number of entries */
+	__u32	ring_entries;	/* power of two */
+	__u64	entries;	/* struct ns9xxx_i2c_sample_entry * */
+};
+
+/* one record in the sample ring */
+struct ns9xxx_i2c_sample {
+	__u64	timestamp_ns;	/* CLOCK_MONOTONIC, end of the data phase */
+	__u16	entry;		/* index into the sampler entries */
+	__u16	addr;
+	__u8	reg;
+	__u8	len;
+	__s16	status;		/* 0 or -errno */
+	__u8	data[NS9XXX_I2C_SAMPLE_MAX];
+};
+
+/*
+ * Submission/completion queues: userspace fills submission entries and
+ * message buffers in the mmap()ed SQ ring and data area, advances the SQ
+ * head and calls NS9XXX_I2C_IOC_QUEUE_SUBMIT. Every transaction posts a
+ * completion entry to the CQ ring, signalled through poll() and the
+ * optional eventfd. Message buffers are used in place, userspace must
+ * not touch them until the completion has been posted.
+ */
+#define NS9XXX_I2C_SQE_MAX_MSGS		4
+
+struct ns9xxx_i2c_sqe_msg {
+	__u16	addr;
+	__u16	flags;		/* I2C_M_RD, I2C_M_TEN, I2C_M_NOSTART,
+				 * I2C_M_IGNORE_NAK */
+	__u16	len;
+	__u16	reserved;
+	__u32	offset;		/* of the buffer in the data area */
+};
+
+/*
+ * Transaction flags (struct ns9xxx_i2c_sqe, struct ns9xxx_i2c_batch_xfer)
+ *
+ * ACKPOLL: while the address of the first message is not acknowledged,
+ * as with an EEPROM that is busy with its write cycle, STOP and address
+ * the device again for up to the ackpoll_timeout module parameter.
+ *
+ * URGENT, BULK: queue in this class instead of the one set for the address
+ * in the qos_class sysfs attribute. Urgent transactions go first; bulk ones
+ * go last and are split (with a STOP) before write messages that have
+ * their own START, never before a read, to let more urgent ones in.
+ *
+ * TIMESTAMP: take CLOCK_MONOTONIC stamps in the interrupt handler when the
+ * address of the first message (with its first byte) and the final STOP
+ * are acknowledged, returned in ts_addr_ns and ts_stop_ns, 0 if the bus
+ * never got there. The completion then waits for the STOP ACK.
+ */
+#define NS9XXX_I2C_XFER_ACKPOLL		0x00000001
+#define NS9XXX_I2C_XFER_URGENT		0x00000002
+#define NS9XXX_I2C_XFER_BULK		0x00000004
+#define NS9XXX_I2C_XFER_TIMESTAMP	0x00000008
+
+/*
+ * Deadlines (deadline_us, in struct ns9xxx_i2c_sqe and struct
+ * ns9xxx_i2c_batch_xfer): microseconds from submission, 0 for none. A
+ * transaction that is not estimated to finish in time, from the bus rate,
+ * the message lengths and what is queued ahead of it, fails with -ETIME
+ * without touching the bus; one that runs out of time on the bus is
+ * stopped after the current byte and fails with -ETIME.
+ */
+
+/* one transaction: START, nmsgs messages, STOP */
+struct ns9xxx_i2c_sqe {
+	__u64	user_data;	/* returned in the completion */
+	__u32	flags;		/* NS9XXX_I2C_XFER_* */
+	__u32	nmsgs;
+	__u32	deadline_us;
+	__u32	reserved;
+	struct ns9xxx_i2c_sqe_msg msgs[NS9XXX_I2C_SQE_MAX_MSGS];
+};
+
+struct ns9xxx_i2c_cqe {
+	__u64	user_data;
+	__s32	result;		/* number of messages or -errno */
+	__u32	flags;
+	__u64	ts_addr_ns;	/* NS9XXX_I2C_XFER_TIMESTAMP */
+	__u64	ts_stop_ns;
+};
+
+struct ns9xxx_i2c_queue_setup {
+	__u32	sq_entries;	/* power of two */
+	__u32	cq_entries;	/* power of two */
+	__u32	data_size;	/* bytes of message buffers */
+	__s32	eventfd;	/* signalled on completion, or -1 */
+};
+
+/*
+ * Batch of independent transactions, each with its own START and STOP.
+ * They are queued together and run back to back while the adapter is
+ * locked; a failing transaction does not stop the ones after it.
+ */
+#define NS9XXX_I2C_BATCH_MAX		256
+#define NS9XXX_I2C_BATCH_MAX_MSGS	42	/* per transaction, as I2C_RDWR */
+
+struct ns9xxx_i2c_batch_xfer {
+	__u64	msgs;		/* struct i2c_msg *, as for I2C_RDWR */
+	__u32	nmsgs;
+	__u32	flags;		/* NS9XXX_I2C_XFER_* */
+	__s32	status;		/* out: number of messages or -errno */
+	__u32	bytes;		/* out: bytes acknowledged on the bus */
+	__u32	deadline_us;
+	__u32	reserved;
+	__u64	ts_addr_ns;	/* out: NS9XXX_I2C_XFER_TIMESTAMP */
+	__u64	ts_stop_ns;	/* out */
+};
+
+struct ns9xxx_i2c_batch {
+	__u64	xfers;		/* struct ns9xxx_i2c_batch_xfer * */
+	__u32	num;
+	__u32	failed;		/* out: transactions with status < 0 */
+};
+
+/*
+ * Transaction scripts: short programs, checked when they are loaded into
+ * one of the slots of an open file, that run against the adapter in a
+ * single ioctl while it is locked. Instructions work on a scratch buffer
+ * that is passed in and returned. A failing XFER ends the script with its
+ * error; inside POLL it just counts as "not yet".
+ *
+ * A run holds the adapter for at most NS9XXX_I2C_SCRIPT_MAX_RUN_US, about
+ * the adapter timeout: a script without backward jumps whose waits add up
+ * to more is refused when it is loaded, one that loops ends with -ETIME
+ * when its time is up. A signal ends a run with -EINTR.
+ */
+#define NS9XXX_I2C_SCRIPT_SLOTS		8
+#define NS9XXX_I2C_SCRIPT_MAX_INSNS	64
+#define NS9XXX_I2C_SCRIPT_SCRATCH	256
+#define NS9XXX_I2C_SCRIPT_MAX_RUN_US	100000
+#define NS9XXX_I2C_SCRIPT_MAX_WAIT_US	NS9XXX_I2C_SCRIPT_MAX_RUN_US
+
+enum ns9xxx_i2c_op {
+	NS9XXX_I2C_OP_END,	/* stop, result is arg (0 to 0x7fffffff) */
+	NS9XXX_I2C_OP_XFER,	/* write wr_len bytes from wr_off, then
+				 * read rd_len bytes to rd_off */
+	NS9XXX_I2C_OP_CMP,	/* flag = (scratch[rd_off] & mask) == value */
+	NS9XXX_I2C_OP_MODIFY,	/* scratch[wr_off] =
+				 *	(scratch[wr_off] & mask) | value */
+	NS9XXX_I2C_OP_POLL,	/* XFER and CMP every interval_us until the
+				 * compare holds (flag = 1) or arg us have
+				 * passed (flag = 0) */
+	NS9XXX_I2C_OP_USLEEP,	/* sleep arg us */
+	NS9XXX_I2C_OP_JUMP,	/* go to instruction arg if cond holds */
+};
+
+/* cond of NS9XXX_I2C_OP_JUMP */
+#define NS9XXX_I2C_JUMP_ALWAYS		0
+#define NS9XXX_I2C_JUMP_IF_SET		1
+#define NS9XXX_I2C_JUMP_IF_CLEAR	2
+
+struct ns9xxx_i2c_insn {
+	__u8	op;
+	__u8	cond;
+	__u16	addr;		/* 7-bit address for XFER and POLL */
+	__u8	wr_off;
+	__u8	wr_len;
+	__u8	rd_off;
+	__u8	rd_len;
+	__u8	mask;
+	__u8	value;
+	__u16	interval_us;
+	__u32	arg;
+};
+
+struct ns9xxx_i2c_script {
+	__u32	slot;
+	__u32	ninsns;		/* 0 frees the slot */
+	__u64	insns;		/* struct ns9xxx_i2c_insn * */
+};
+
+struct ns9xxx_i2c_script_run {
+	__u32	slot;
+	__s32	result;		/* out: END argument or -errno */
+	__u32	pc;		/* out: instruction the script ended on */
+	__u32	reserved;
+	__u64	scratch;	/* __u8[NS9XXX_I2C_SCRIPT_SCRATCH], in/out */
+};
+
+/*
+ * Bulk EEPROM/flash access: the range is split at page boundaries for
+ * writes (each page polled for the end of the previous write cycle) and
+ * into the longest possible sequential reads. Memory address bits beyond
+ * addr_len bytes go into the low bits of the device address, as on the
+ * 24c16 or 24c1024, so a page is at most 256 bytes with addr_len 1. The
+ * transfer stops at the first failed page or read.
+ */
+#define NS9XXX_I2C_EEPROM_MAX_LEN	(1 << 20)
+#define NS9XXX_I2C_EEPROM_MAX_PAGE	4096
+
+struct ns9xxx_i2c_eeprom {
+	__u16	addr;		/* 7-bit device address */
+	__u8	addr_len;	/* memory address bytes, 1 or 2 */
+	__u8	write;		/* 0 to read, 1 to write */
+	__u32	page_size;	/* power of two, for writes */
+	__u32	offset;		/* memory address */
+	__u32	len;
+	__u64	buf;
+	__u64	elapsed_ns;	/* out: first START to last completion */
+	__u64	wire_ns;	/* out: the same traffic at the bus rate */
+	__u32	done;		/* out: bytes transferred */
+	__u32	reserved;
+};
+
+/*
+ * Slave mailbox: NS9XXX_I2C_IOC_SLAVE_MBOX, with the 7-bit slave address
+ * as argument, attaches the "mailbox" backend for the calling file (EBUSY
+ * if another file has it). Every frame a remote master then writes to the
+ * slave address (START to STOP) becomes one entry of the ring that file
+ * maps at NS9XXX_I2C_OFF_SLAVE, and its poll() reports POLLIN while the
+ * ring is not empty. The backend is detached when the file is closed.
+ */
+#define NS9XXX_I2C_FRAME_MAX		240
+#define NS9XXX_I2C_FRAME_TRUNCATED	0x0001	/* bytes past FRAME_MAX lost */
+
+struct ns9xxx_i2c_frame {
+	__u64	timestamp_ns;	/* CLOCK_MONOTONIC, address match */
+	__u16	len;
+	__u16	flags;
+	__u32	reserved;
+	__u8	data[NS9XXX_I2C_FRAME_MAX];
+};
+
+/*
+ * Transaction records, read from i2c-ns9xxx/i2c-N/record in debugfs while
+ * it is open: a struct ns9xxx_i2c_record_hdr, then for every transfer of
+ * the adapter a struct ns9xxx_i2c_record, its nmsgs struct
+ * ns9xxx_i2c_record_msg and the data of its write messages, in order.
+ * tools/i2c-ns9xxx/i2c-ns9xxx-replay plays them back.
+ */
+#define NS9XXX_I2C_RECORD_MAGIC		0x4e533252	/* "NS2R" */
+#define NS9XXX_I2C_RECORD_VERSION	1
+
+struct ns9xxx_i2c_record_hdr {
+	__u32	magic;
+	__u16	version;
+	__u16	bus;		/* adapter number */
+	__u32	bus_freq;	/* Hz, when recording started */
+	__u32	reserved;
+};
+
+struct ns9xxx_i2c_record {
+	__u64	start_ns;	/* CLOCK_MONOTONIC */
+	__u32	duration_ns;
+	__s32	result;		/* number of messages or -errno */
+	__u16	nmsgs;
+	__u16	reserved;
+	__u32	data_len;	/* bytes of write data after the messages */
+};
+
+struct ns9xxx_i2c_record_msg {
+	__u16	addr;
+	__u16	flags;		/* I2C_M_* */
+	__u16	len;
+	__u16	reserved;
+};
+
+#define NS9XXX_I2C_IOC_MAGIC		'N'
+
+#define NS9XXX_I2C_IOC_SAMPLER_START	_IOW(NS9XXX_I2C_IOC_MAGIC, 0x01, \
+						struct ns9xxx_i2c_sampler)
+#define NS9XXX_I2C_IOC_SAMPLER_STOP	_IO(NS9XXX_I2C_IOC_MAGIC, 0x02)
+#define NS9XXX_I2C_IOC_QUEUE_SETUP	_IOW(NS9XXX_I2C_IOC_MAGIC, 0x10, \
+						struct ns9xxx_i2c_queue_setup)
+/* returns the number of submission entries consumed */
+#define NS9XXX_I2C_IOC_QUEUE_SUBMIT	_IO(NS9XXX_I2C_IOC_MAGIC, 0x11)
+#define NS9XXX_I2C_IOC_BATCH		_IOWR(NS9XXX_I2C_IOC_MAGIC, 0x20, \
+						struct ns9xxx_i2c_batch)
+#define NS9XXX_I2C_IOC_SCRIPT_LOAD	_IOW(NS9XXX_I2C_IOC_MAGIC, 0x30, \
+						struct ns9xxx_i2c_script)
+#define NS9XXX_I2C_IOC_SCRIPT_RUN	_IOWR(NS9XXX_I2C_IOC_MAGIC, 0x31, \
+						struct ns9xxx_i2c_script_run)
+#define NS9XXX_I2C_IOC_EEPROM		_IOWR(NS9XXX_I2C_IOC_MAGIC, 0x40, \
+						struct ns9xxx_i2c_eeprom)
+#define NS9XXX_I2C_IOC_SLAVE_MBOX	_IO(NS9XXX_I2C_IOC_MAGIC, 0x50)
+
+#endif /* __LINUX_I2C_NS9XXX_DEV_H */
@@ -0,0 +1,23 @@
+/*
+ * include/linux/i2c-ns9xxx.h
+ *
+ * Platform data of drivers/i2c/busses/i2c-ns9xxx.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#ifndef __LINUX_I2C_NS9XXX_H
+#define __LINUX_I2C_NS9XXX_H
+
+struct plat_ns9xxx_i2c {
+	unsigned int gpio_scl;
+	unsigned int gpio_sda;
+	unsigned int speed;		/* bus frequency, 0 for 100 kHz */
+	void (*gpio_configuration_func)(void);
+	/* SMBALERT# input (active low), 0 if the board has none */
+	unsigned int gpio_alert;
+};
+
+#endif /* __LINUX_I2C_NS9XXX_H */
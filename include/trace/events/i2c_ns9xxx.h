@@ -0,0 +1,223 @@
+/*
+ * include/trace/events/i2c_ns9xxx.h
+ *
+ * Tracepoints of drivers/i2c/busses/i2c-ns9xxx.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM i2c_ns9xxx
+
+#if !defined(_TRACE_I2C_NS9XXX_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_I2C_NS9XXX_H
+
+#include <linux/tracepoint.h>
+
+#ifndef _TRACE_I2C_NS9XXX_DEF
+#define _TRACE_I2C_NS9XXX_DEF
+
+/* steps of getting a locked master module or a stuck bus going again */
+enum ns9xxx_recovery_stage {
+	NS9XXX_RECOVERY_WAIT_BUSY,	/* val: STATUS */
+	NS9XXX_RECOVERY_UNLOCKED,	/* val: STATUS */
+	NS9XXX_RECOVERY_REINIT,		/* val: attempt */
+	NS9XXX_RECOVERY_HW_REINIT,	/* val: STATUS */
+	NS9XXX_RECOVERY_GIVE_UP,	/* val: attempts */
+	NS9XXX_RECOVERY_UNSTICK,	/* val: state */
+	NS9XXX_RECOVERY_BITBANG,	/* val: 0 */
+	NS9XXX_RECOVERY_BITBANG_DONE,	/* val: effective clock cycles */
+};
+
+#endif
+
+#define show_ns9xxx_recovery_stage(stage)				\
+	__print_symbolic(stage,						\
+		{ NS9XXX_RECOVERY_WAIT_BUSY,	"wait_busy" },		\
+		{ NS9XXX_RECOVERY_UNLOCKED,	"unlocked" },		\
+		{ NS9XXX_RECOVERY_REINIT,	"reinit" },		\
+		{ NS9XXX_RECOVERY_HW_REINIT,	"hw_reinit" },		\
+		{ NS9XXX_RECOVERY_GIVE_UP,	"give_up" },		\
+		{ NS9XXX_RECOVERY_UNSTICK,	"unstick" },		\
+		{ NS9XXX_RECOVERY_BITBANG,	"bitbang" },		\
+		{ NS9XXX_RECOVERY_BITBANG_DONE,	"bitbang_done" })
+
+/* enum ns9xxx_engine_phase, private to the driver */
+#define show_ns9xxx_phase(phase)					\
+	__print_symbolic(phase,						\
+		{ -1,	"none" },					\
+		{ 0,	"idle" },					\
+		{ 1,	"xfer" },					\
+		{ 2,	"stop" },					\
+		{ 3,	"restart" },					\
+		{ 4,	"ackpoll" },					\
+		{ 5,	"ackwait" },					\
+		{ 6,	"sync" })
+
+/* a command written to I2C_CMD, by the engine or ns9xxx_i2c_send_cmd() */
+TRACE_EVENT(i2c_ns9xxx_cmd,
+
+	TP_PROTO(int nr, u32 cmd),
+
+	TP_ARGS(nr, cmd),
+
+	TP_STRUCT__entry(
+		__field(	int,	nr	)
+		__field(	u32,	cmd	)
+	),
+
+	TP_fast_assign(
+		__entry->nr	= nr;
+		__entry->cmd	= cmd;
+	),
+
+	TP_printk("i2c-%d cmd=0x%04x", __entry->nr, __entry->cmd)
+);
+
+/* I2C_STATUS as read by the interrupt handler */
+TRACE_EVENT(i2c_ns9xxx_irq,
+
+	TP_PROTO(int nr, u32 status),
+
+	TP_ARGS(nr, status),
+
+	TP_STRUCT__entry(
+		__field(	int,	nr	)
+		__field(	u32,	status	)
+	),
+
+	TP_fast_assign(
+		__entry->nr	= nr;
+		__entry->status	= status;
+	),
+
+	TP_printk("i2c-%d status=0x%08x code=%u", __entry->nr,
+		__entry->status, (__entry->status >> 8) & 0xf)
+);
+
+/* engine phase change, enum ns9xxx_engine_phase */
+TRACE_EVENT(i2c_ns9xxx_phase,
+
+	TP_PROTO(int nr, int from, int to),
+
+	TP_ARGS(nr, from, to),
+
+	TP_STRUCT__entry(
+		__field(	int,	nr	)
+		__field(	int,	from	)
+		__field(	int,	to	)
+	),
+
+	TP_fast_assign(
+		__entry->nr	= nr;
+		__entry->from	= from;
+		__entry->to	= to;
+	),
+
+	TP_printk("i2c-%d phase %s -> %s", __entry->nr,
+		show_ns9xxx_phase(__entry->from), show_ns9xxx_phase(__entry->to))
+);
+
+/*
+ * no interrupt in time: from the engine, cmd is 0 and phase is where it
+ * was; from ns9xxx_i2c_send_cmd(), phase is -1
+ */
+TRACE_EVENT(i2c_ns9xxx_timeout,
+
+	TP_PROTO(int nr, int phase, u32 cmd),
+
+	TP_ARGS(nr, phase, cmd),
+
+	TP_STRUCT__entry(
+		__field(	int,	nr	)
+		__field(	int,	phase	)
+		__field(	u32,	cmd	)
+	),
+
+	TP_fast_assign(
+		__entry->nr	= nr;
+		__entry->phase	= phase;
+		__entry->cmd	= cmd;
+	),
+
+	TP_printk("i2c-%d phase=%s cmd=0x%04x", __entry->nr,
+		show_ns9xxx_phase(__entry->phase), __entry->cmd)
+);
+
+TRACE_EVENT(i2c_ns9xxx_recovery,
+
+	TP_PROTO(int nr, int stage, u32 val),
+
+	TP_ARGS(nr, stage, val),
+
+	TP_STRUCT__entry(
+		__field(	int,	nr	)
+		__field(	int,	stage	)
+		__field(	u32,	val	)
+	),
+
+	TP_fast_assign(
+		__entry->nr	= nr;
+		__entry->stage	= stage;
+		__entry->val	= val;
+	),
+
+	TP_printk("i2c-%d %s val=0x%x", __entry->nr,
+		show_ns9xxx_recovery_stage(__entry->stage), __entry->val)
+);
+
+/* line levels during a GPIO bus reset: cycle 0 before, 1-9 clocks, 10 STOP */
+TRACE_EVENT(i2c_ns9xxx_bitbang,
+
+	TP_PROTO(int nr, int cycle, int scl, int sda),
+
+	TP_ARGS(nr, cycle, scl, sda),
+
+	TP_STRUCT__entry(
+		__field(	int,	nr	)
+		__field(	int,	cycle	)
+		__field(	int,	scl	)
+		__field(	int,	sda	)
+	),
+
+	TP_fast_assign(
+		__entry->nr	= nr;
+		__entry->cycle	= cycle;
+		__entry->scl	= scl;
+		__entry->sda	= sda;
+	),
+
+	TP_printk("i2c-%d cycle=%d scl=%d sda=%d", __entry->nr,
+		__entry->cycle, __entry->scl, __entry->sda)
+);
+
+TRACE_EVENT(i2c_ns9xxx_clock,
+
+	TP_PROTO(int nr, unsigned int freq, unsigned long ref, u32 config),
+
+	TP_ARGS(nr, freq, ref, config),
+
+	TP_STRUCT__entry(
+		__field(	int,		nr	)
+		__field(	unsigned int,	freq	)
+		__field(	unsigned long,	ref	)
+		__field(	u32,		config	)
+	),
+
+	TP_fast_assign(
+		__entry->nr	= nr;
+		__entry->freq	= freq;
+		__entry->ref	= ref;
+		__entry->config	= config;
+	),
+
+	TP_printk("i2c-%d freq=%u clk=%lu config=0x%08x", __entry->nr,
+		__entry->freq, __entry->ref, __entry->config)
+);
+
+#endif /* _TRACE_I2C_NS9XXX_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
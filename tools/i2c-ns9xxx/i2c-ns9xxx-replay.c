@@ -0,0 +1,435 @@
+/*
+ * tools/i2c-ns9xxx/i2c-ns9xxx-replay.c
+ *
+ * Replays transactions recorded from i2c-ns9xxx/i2c-N/record in debugfs
+ * (see include/linux/i2c-ns9xxx-dev.h) and reports throughput, latency
+ * percentiles and errors, to benchmark the driver against a real workload.
+ *
+ *	cat /sys/kernel/debug/i2c-ns9xxx/i2c-0/record > workload.rec
+ *	i2c-ns9xxx-replay -y -s 4 workload.rec
+ *
+ * Transactions go through I2C_RDWR on /dev/i2c-N, or with -b through
+ * NS9XXX_I2C_IOC_BATCH on /dev/i2c-ns9xxx-N, spaced as they were recorded
+ * divided by the -s factor (0: back to back). With -S nothing is sent: each
+ * transaction takes its bus time at the recorded rate and returns the
+ * recorded result, to check the tool and the pacing on their own.
+ *
+ * Build with make in this directory (CC=... to cross-compile).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c-ns9xxx-dev.h>
+
+#define NSEC_PER_SEC	1000000000ULL
+
+struct xact {
+	struct ns9xxx_i2c_record	rec;
+	struct i2c_msg			*msgs;
+	uint64_t			due;		/* ns from replay start */
+	uint64_t			latency;	/* ns from due */
+	uint64_t			service;	/* ns from issue */
+	int				result;
+};
+
+static struct ns9xxx_i2c_record_hdr hdr;
+static struct xact *xacts;
+static unsigned int nxacts;
+
+static double speed = 1.0;
+static unsigned int batch;
+static int simulate;
+static unsigned int bus_freq;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts = {
+		.tv_sec		= t / NSEC_PER_SEC,
+		.tv_nsec	= t % NSEC_PER_SEC,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+			EINTR)
+		;
+}
+
+static int read_full(FILE *f, void *buf, size_t len)
+{
+	return len && fread(buf, len, 1, f) != 1 ? -1 : 0;
+}
+
+static int load(const char *path)
+{
+	struct ns9xxx_i2c_record_msg m;
+	unsigned int size = 0, i;
+	uint64_t first = 0;
+	struct xact *x;
+	uint8_t *data;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	if (read_full(f, &hdr, sizeof(hdr)) ||
+			hdr.magic != NS9XXX_I2C_RECORD_MAGIC ||
+			hdr.version != NS9XXX_I2C_RECORD_VERSION) {
+		fprintf(stderr, "%s: not a version %u transaction record\n",
+				path, NS9XXX_I2C_RECORD_VERSION);
+		goto err;
+	}
+
+	for (;;) {
+		if (nxacts == size) {
+			size = size ? 2 * size : 1024;
+			xacts = realloc(xacts, size * sizeof(*xacts));
+			if (!xacts)
+				goto err_nomem;
+		}
+		x = &xacts[nxacts];
+
+		if (read_full(f, &x->rec, sizeof(x->rec)))
+			break;	/* end of file, or a record cut short */
+
+		/* nothing to replay, and nothing for calloc() to allocate */
+		if (!x->rec.nmsgs) {
+			if (x->rec.data_len &&
+					fseek(f, x->rec.data_len, SEEK_CUR))
+				goto err_short;
+			continue;
+		}
+
+		x->msgs = calloc(x->rec.nmsgs, sizeof(*x->msgs));
+		data = malloc(x->rec.data_len);
+		if (!x->msgs || (x->rec.data_len && !data))
+			goto err_nomem;
+
+		for (i = 0; i < x->rec.nmsgs; i++) {
+			if (read_full(f, &m, sizeof(m)))
+				goto err_short;
+			x->msgs[i].addr = m.addr;
+			x->msgs[i].flags = m.flags;
+			x->msgs[i].len = m.len;
+		}
+		if (read_full(f, data, x->rec.data_len))
+			goto err_short;
+
+		/* writes point into the recorded data, reads get a buffer */
+		for (i = 0; i < x->rec.nmsgs; i++) {
+			if (x->msgs[i].flags & I2C_M_RD) {
+				x->msgs[i].buf = malloc(x->msgs[i].len + 1);
+				if (!x->msgs[i].buf)
+					goto err_nomem;
+			} else {
+				x->msgs[i].buf = data;
+				data += x->msgs[i].len;
+			}
+		}
+
+		if (!nxacts)
+			first = x->rec.start_ns;
+		x->due = speed > 0 ?
+			(uint64_t)((x->rec.start_ns - first) / speed) : 0;
+		nxacts++;
+	}
+
+	fclose(f);
+	return 0;
+
+err_short:
+	fprintf(stderr, "%s: record %u cut short\n", path, nxacts);
+	goto err;
+err_nomem:
+	fprintf(stderr, "out of memory\n");
+err:
+	fclose(f);
+	return -1;
+}
+
+/* bus time of a transaction, as ns9xxx_wire_ns() in the driver */
+static uint64_t wire_ns(const struct xact *x)
+{
+	uint64_t clocks = 1;
+	unsigned int i;
+
+	for (i = 0; i < x->rec.nmsgs; i++) {
+		clocks += 9 * x->msgs[i].len;
+		if (!(x->msgs[i].flags & I2C_M_NOSTART))
+			clocks += 1 + 9 *
+				((x->msgs[i].flags & I2C_M_TEN) ? 2 : 1);
+	}
+
+	return clocks * NSEC_PER_SEC / bus_freq;
+}
+
+static int run_one(int fd, struct xact *x)
+{
+	struct i2c_rdwr_ioctl_data rdwr = {
+		.msgs	= x->msgs,
+		.nmsgs	= x->rec.nmsgs,
+	};
+	int ret;
+
+	if (simulate) {
+		sleep_until(now_ns() + wire_ns(x));
+		return x->rec.result;
+	}
+
+	ret = ioctl(fd, I2C_RDWR, &rdwr);
+	return ret < 0 ? -errno : ret;
+}
+
+static int run_batch(int fd, struct xact *x, unsigned int num)
+{
+	static struct ns9xxx_i2c_batch_xfer bx[NS9XXX_I2C_BATCH_MAX];
+	struct ns9xxx_i2c_batch b = {
+		.xfers	= (uintptr_t)bx,
+		.num	= num,
+	};
+	unsigned int i;
+
+	memset(bx, 0, num * sizeof(*bx));
+	for (i = 0; i < num; i++) {
+		bx[i].msgs = (uintptr_t)x[i].msgs;
+		bx[i].nmsgs = x[i].rec.nmsgs;
+	}
+
+	if (ioctl(fd, NS9XXX_I2C_IOC_BATCH, &b) < 0)
+		return -errno;
+
+	for (i = 0; i < num; i++)
+		x[i].result = bx[i].status;
+
+	return 0;
+}
+
+static int replay(int fd, uint64_t *elapsed)
+{
+	uint64_t start, issue, done;
+	unsigned int i = 0, num, j;
+	int ret;
+
+	start = now_ns();
+	while (i < nxacts) {
+		sleep_until(start + xacts[i].due);
+		issue = now_ns();
+
+		/* whatever is already due goes in the same batch */
+		num = 1;
+		if (batch && !simulate)
+			while (i + num < nxacts && num < batch &&
+					start + xacts[i + num].due <= issue)
+				num++;
+
+		if (batch && !simulate) {
+			ret = run_batch(fd, &xacts[i], num);
+			if (ret) {
+				fprintf(stderr, "NS9XXX_I2C_IOC_BATCH: %s\n",
+						strerror(-ret));
+				return -1;
+			}
+		} else {
+			xacts[i].result = run_one(fd, &xacts[i]);
+		}
+
+		/*
+		 * Latency counts from when the transaction was due, so that
+		 * a replay falling behind shows; service time from when it
+		 * was actually issued.
+		 */
+		done = now_ns();
+		for (j = i; j < i + num; j++) {
+			xacts[j].latency = done - (start + xacts[j].due);
+			xacts[j].service = done - issue;
+		}
+		i += num;
+	}
+	*elapsed = now_ns() - start;
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *what, uint64_t *v, unsigned int n)
+{
+	qsort(v, n, sizeof(*v), cmp_u64);
+	printf("%-10s p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us\n", what,
+			v[n * 50 / 100] / 1e3, v[n * 90 / 100] / 1e3,
+			v[n * 99 / 100] / 1e3, v[n - 1] / 1e3);
+}
+
+static void report(uint64_t elapsed)
+{
+	unsigned int errors = 0, changed = 0, i, j, k;
+	unsigned int nerrno = 0, counts[16];
+	int errnos[16];
+	uint64_t bytes = 0, *v;
+
+	for (i = 0; i < nxacts; i++) {
+		struct xact *x = &xacts[i];
+
+		if ((x->result < 0) != (x->rec.result < 0))
+			changed++;
+		if (x->result >= 0) {
+			for (j = 0; j < x->rec.nmsgs; j++)
+				bytes += x->msgs[j].len;
+			continue;
+		}
+
+		errors++;
+		for (k = 0; k < nerrno && errnos[k] != x->result; k++)
+			;
+		if (k == nerrno && nerrno < 16) {
+			errnos[nerrno] = x->result;
+			counts[nerrno++] = 0;
+		}
+		if (k < nerrno)
+			counts[k]++;
+	}
+
+	printf("bus %u, recorded at %u Hz, %s, pacing %s%.2g\n", hdr.bus,
+			hdr.bus_freq, simulate ? "simulated" :
+			batch ? "NS9XXX_I2C_IOC_BATCH" : "I2C_RDWR",
+			speed > 0 ? "x" : "", speed > 0 ? speed : 0.0);
+	printf("%u transactions in %.3f s: %.1f/s, %.1f bytes/s\n", nxacts,
+			elapsed / 1e9, nxacts * 1e9 / elapsed,
+			bytes * 1e9 / elapsed);
+	printf("%u errors, %u differ from the recording\n", errors, changed);
+	for (k = 0; k < nerrno; k++)
+		printf("  %-24s %u\n", strerror(-errnos[k]), counts[k]);
+
+	v = malloc(nxacts * sizeof(*v));
+	if (!v)
+		return;
+	for (i = 0; i < nxacts; i++)
+		v[i] = xacts[i].latency;
+	print_percentiles("latency", v, nxacts);
+	for (i = 0; i < nxacts; i++)
+		v[i] = xacts[i].service;
+	print_percentiles("service", v, nxacts);
+	for (i = 0; i < nxacts; i++)
+		v[i] = xacts[i].rec.duration_ns;
+	print_percentiles("recorded", v, nxacts);
+	free(v);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: i2c-ns9xxx-replay [-y] [-s factor] [-b max] "
+				"[-d device] [-S [-f hz]] record\n"
+		"  -y         send to the adapter (writes included)\n"
+		"  -s factor  pacing: recorded spacing / factor, 0 for none "
+				"(default 1)\n"
+		"  -b max     use NS9XXX_I2C_IOC_BATCH, up to max "
+				"transactions per call\n"
+		"  -d device  /dev/i2c-N or /dev/i2c-ns9xxx-N (default "
+				"from the record)\n"
+		"  -S         simulate the adapter instead\n"
+		"  -f hz      bus rate for -S (default the recorded one)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = NULL;
+	char path[32];
+	uint64_t elapsed;
+	int yes = 0, fd = -1, c;
+
+	while ((c = getopt(argc, argv, "ys:b:d:Sf:")) != -1) {
+		switch (c) {
+		case 'y':
+			yes = 1;
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			if (!batch || batch > NS9XXX_I2C_BATCH_MAX)
+				usage();
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'S':
+			simulate = 1;
+			break;
+		case 'f':
+			bus_freq = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || speed < 0)
+		usage();
+
+	if (load(argv[optind]))
+		return 1;
+	if (!nxacts) {
+		fprintf(stderr, "%s: no transactions\n", argv[optind]);
+		return 1;
+	}
+
+	if (simulate) {
+		if (!bus_freq)
+			bus_freq = hdr.bus_freq ? hdr.bus_freq : 100000;
+	} else {
+		if (!yes) {
+			fprintf(stderr, "replaying writes to a live bus "
+					"needs -y (or -S to simulate)\n");
+			return 2;
+		}
+		if (!device) {
+			snprintf(path, sizeof(path), batch ?
+					"/dev/i2c-ns9xxx-%u" : "/dev/i2c-%u",
+					hdr.bus);
+			device = path;
+		}
+		fd = open(device, O_RDWR);
+		if (fd < 0) {
+			perror(device);
+			return 1;
+		}
+	}
+
+	if (replay(fd, &elapsed))
+		return 1;
+	report(elapsed);
+
+	if (fd >= 0)
+		close(fd);
+
+	return 0;
+}